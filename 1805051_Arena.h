@@ -0,0 +1,88 @@
+// Bump allocator owning every primitive of a loaded scene. Objects are placed
+// back to back in large blocks and are destroyed and released together by
+// reset(), so reloading a scene never leaks and traversal touches contiguous
+// memory.
+
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+using namespace std;
+
+struct SceneArena
+{
+    struct Block
+    {
+        char *data;
+        size_t used, size;
+    };
+
+    vector<Block> blocks;
+    vector<pair<void *, void (*)(void *)>> destructors;
+    size_t blockSize;
+
+    SceneArena(size_t blockSize = 64 * 1024) : blockSize(blockSize) {}
+    SceneArena(const SceneArena &) = delete;
+    SceneArena &operator=(const SceneArena &) = delete;
+
+    ~SceneArena() { reset(); }
+
+    void *allocate(size_t bytes, size_t align)
+    {
+        if (!blocks.empty())
+        {
+            Block &b = blocks.back();
+            size_t offset = (b.used + align - 1) & ~(align - 1);
+            if (offset + bytes <= b.size)
+            {
+                b.used = offset + bytes;
+                return b.data + offset;
+            }
+        }
+        Block b;
+        b.size = max(blockSize, bytes + align);
+        b.data = (char *)::operator new(b.size);
+        b.used = 0;
+        blocks.push_back(b);
+        size_t offset = ((size_t)b.data + align - 1) & ~(align - 1);
+        offset -= (size_t)b.data;
+        blocks.back().used = offset + bytes;
+        return b.data + offset;
+    }
+
+    template <class T, class... Args>
+    T *make(Args &&...args)
+    {
+        T *obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!is_trivially_destructible<T>::value)
+            destructors.push_back(make_pair((void *)obj, &destroy<T>));
+        return obj;
+    }
+
+    template <class T>
+    static void destroy(void *p)
+    {
+        ((T *)p)->~T();
+    }
+
+    // destroy everything, newest first, and give the blocks back
+    void reset()
+    {
+        for (int i = (int)destructors.size() - 1; i >= 0; i--)
+            destructors[i].second(destructors[i].first);
+        destructors.clear();
+        for (int i = 0; i < (int)blocks.size(); i++)
+            ::operator delete(blocks[i].data);
+        blocks.clear();
+    }
+
+    size_t bytesUsed()
+    {
+        size_t total = 0;
+        for (int i = 0; i < (int)blocks.size(); i++)
+            total += blocks[i].used;
+        return total;
+    }
+};
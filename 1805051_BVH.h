@@ -0,0 +1,1065 @@
+// Bounding volume hierarchy over the bounded objects of the scene.
+// Unbounded primitives (the Floor plane) stay outside the tree so they never
+// inflate the root box; they are tested analytically next to it.
+
+#include <atomic>
+#include <cassert>
+#include <cfloat>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// run body(i) for every i in [0, count) on up to threads threads
+void parallelFor(int count, int threads, const function<void(int)> &body)
+{
+    threads = max(1, min(threads, count));
+    if (threads == 1)
+    {
+        for (int i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+    atomic<int> next(0);
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++)
+        pool.push_back(thread([&]
+                              {
+                                  for (int i = next++; i < count; i = next++)
+                                      body(i);
+                              }));
+    for (int t = 0; t < (int)pool.size(); t++)
+        pool[t].join();
+}
+
+struct AABB
+{
+    point lo, hi;
+
+    AABB() : lo(1e300, 1e300, 1e300), hi(-1e300, -1e300, -1e300) {}
+    AABB(point lo, point hi) : lo(lo), hi(hi) {}
+
+    void expand(const AABB &b)
+    {
+        lo = point(min(lo.x, b.lo.x), min(lo.y, b.lo.y), min(lo.z, b.lo.z));
+        hi = point(max(hi.x, b.hi.x), max(hi.y, b.hi.y), max(hi.z, b.hi.z));
+    }
+
+    void expand(point p)
+    {
+        lo = point(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = point(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+
+    point center() { return (lo + hi) * 0.5; }
+
+    double area()
+    {
+        point d = hi - lo;
+        if (d.x < 0)
+            return 0;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    int longestAxis()
+    {
+        point d = hi - lo;
+        if (d.x >= d.y && d.x >= d.z)
+            return 0;
+        return d.y >= d.z ? 1 : 2;
+    }
+
+    // slab test; true if the ray overlaps the box somewhere in [tMin, tMax]
+    bool hit(const point &origin, const point &invDir, double tMin, double tMax)
+    {
+        double t0 = tMin, t1 = tMax;
+        double o[3] = {origin.x, origin.y, origin.z};
+        double inv[3] = {invDir.x, invDir.y, invDir.z};
+        double l[3] = {lo.x, lo.y, lo.z};
+        double h[3] = {hi.x, hi.y, hi.z};
+        for (int k = 0; k < 3; k++)
+        {
+            double tNear = (l[k] - o[k]) * inv[k];
+            double tFar = (h[k] - o[k]) * inv[k];
+            if (tNear > tFar)
+                swap(tNear, tFar);
+            // NaN (origin on a slab plane of a flat box) keeps the box
+            if (tNear > t0)
+                t0 = tNear;
+            if (tFar < t1)
+                t1 = tFar;
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+};
+
+// convex volume bounded by inward facing planes n * p + d >= 0
+struct Frustum
+{
+    point normal[6];
+    double offset[6];
+    int planes;
+
+    Frustum() : planes(0) {}
+
+    void add(point n, point through)
+    {
+        normal[planes] = n;
+        offset[planes] = -(n * through);
+        planes++;
+    }
+
+    // false only if the box lies entirely outside one of the planes
+    bool overlaps(const AABB &box)
+    {
+        for (int k = 0; k < planes; k++)
+        {
+            point n = normal[k];
+            point p(n.x >= 0 ? box.hi.x : box.lo.x, n.y >= 0 ? box.hi.y : box.lo.y, n.z >= 0 ? box.hi.z : box.lo.z);
+            if (n * p + offset[k] < 0)
+                return false;
+        }
+        return true;
+    }
+};
+
+double axisOf(point p, int axis)
+{
+    return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+}
+
+struct BVHNode
+{
+    AABB box;
+    int left, right; // children, -1 for leaves
+    int first, count; // leaf range in BVH::items
+};
+
+// Compressed layout (--bvh compressed). The binary tree is collapsed to four
+// children per node and each child box is stored as 8-bit steps on a grid
+// spanning the parent, so one node is one 64-byte cache line instead of a
+// 64-byte node per box. Lower bounds round down and upper bounds up, checked
+// against packedBound(), the decoding the traversal uses, so a stored box
+// can only be larger than the real one and no hit is lost.
+struct alignas(64) PackedNode
+{
+    float origin[3], scale[3]; // grid of the node: origin + q * scale per axis
+    unsigned char lo[3][4], hi[3][4]; // [axis][child]
+    unsigned int child[4]; // packed node index, packedLeaf(), or PACKED_EMPTY
+};
+
+static_assert(sizeof(PackedNode) == 64, "a packed node should fill one cache line");
+
+const unsigned int PACKED_LEAF = 0x80000000u;
+const unsigned int PACKED_EMPTY = 0xffffffffu;
+const int PACKED_MAX_LEAF = 14;         // count takes 4 bits, 15 is left for PACKED_EMPTY
+const int PACKED_MAX_ITEMS = 1 << 27;   // first item takes the low 27 bits
+
+inline unsigned int packedLeaf(int first, int count)
+{
+    return PACKED_LEAF | (unsigned int)count << 27 | (unsigned int)first;
+}
+
+inline double packedBound(const PackedNode &n, int axis, unsigned char q)
+{
+    return (double)n.origin[axis] + q * (double)n.scale[axis];
+}
+
+// slab tests of a node's four children in the arithmetic of AABB::hit;
+// bit c of the result is set when child c is hit, entering at near[c]
+inline int packedHits(const PackedNode &n, const double *o, const double *inv, double tMin, double tMax, double *near)
+{
+#ifdef BITMAP_IMAGE_SSE2
+    __m128d t0[2] = {_mm_set1_pd(tMin), _mm_set1_pd(tMin)}, t1[2] = {_mm_set1_pd(tMax), _mm_set1_pd(tMax)};
+    const __m128i zero = _mm_setzero_si128();
+    for (int a = 0; a < 3; a++)
+    {
+        __m128d origin = _mm_set1_pd(n.origin[a]), scale = _mm_set1_pd(n.scale[a]);
+        __m128d oa = _mm_set1_pd(o[a]), ia = _mm_set1_pd(inv[a]);
+        int packedLo, packedHi;
+        memcpy(&packedLo, n.lo[a], 4);
+        memcpy(&packedHi, n.hi[a], 4);
+        __m128i qlo = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedLo), zero), zero);
+        __m128i qhi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedHi), zero), zero);
+        for (int half = 0; half < 2; half++)
+        {
+            __m128d lo = _mm_add_pd(origin, _mm_mul_pd(_mm_cvtepi32_pd(qlo), scale));
+            __m128d hi = _mm_add_pd(origin, _mm_mul_pd(_mm_cvtepi32_pd(qhi), scale));
+            __m128d tNear = _mm_mul_pd(_mm_sub_pd(lo, oa), ia), tFar = _mm_mul_pd(_mm_sub_pd(hi, oa), ia);
+            // swap where tNear > tFar; max/min keep the old bound for NaN
+            __m128d swapped = _mm_cmpgt_pd(tNear, tFar);
+            __m128d enter = _mm_or_pd(_mm_and_pd(swapped, tFar), _mm_andnot_pd(swapped, tNear));
+            __m128d leave = _mm_or_pd(_mm_and_pd(swapped, tNear), _mm_andnot_pd(swapped, tFar));
+            t0[half] = _mm_max_pd(enter, t0[half]);
+            t1[half] = _mm_min_pd(leave, t1[half]);
+            qlo = _mm_srli_si128(qlo, 8);
+            qhi = _mm_srli_si128(qhi, 8);
+        }
+    }
+    _mm_storeu_pd(near, t0[0]);
+    _mm_storeu_pd(near + 2, t0[1]);
+    return _mm_movemask_pd(_mm_cmple_pd(t0[0], t1[0])) | _mm_movemask_pd(_mm_cmple_pd(t0[1], t1[1])) << 2;
+#else
+    int mask = 0;
+    for (int c = 0; c < 4; c++)
+    {
+        double t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; a++)
+        {
+            double tNear = (packedBound(n, a, n.lo[a][c]) - o[a]) * inv[a];
+            double tFar = (packedBound(n, a, n.hi[a][c]) - o[a]) * inv[a];
+            if (tNear > tFar)
+                swap(tNear, tFar);
+            if (tNear > t0)
+                t0 = tNear;
+            if (tFar < t1)
+                t1 = tFar;
+        }
+        near[c] = t0;
+        if (t0 <= t1)
+            mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+// layout chosen for trees built from now on; see PackedNode
+extern bool compressedBVH;
+
+// how the binary tree is split (--bvh-build); every builder gives the same
+// hits, they differ in build time and in how fast the tree traces
+enum BVHBuilder
+{
+    BUILD_MEDIAN, // object median on the widest axis of centers
+    BUILD_SAH,    // binned surface area heuristic on all three axes
+    BUILD_LBVH    // Morton order split at the highest differing bit; fastest, loosest
+};
+
+extern BVHBuilder bvhBuilder;
+extern int renderThreads;
+
+const char *builderName(BVHBuilder builder)
+{
+    return builder == BUILD_MEDIAN ? "median" : builder == BUILD_SAH ? "sah" : "lbvh";
+}
+
+const int SAH_BINS = 16;
+const int PARALLEL_BUILD_MIN = 4096; // smaller subtrees stay on the thread that reached them
+const int PARALLEL_BIN_MIN = 65536;  // larger nodes are binned on several threads
+// SAH and Morton splits may peel off one item per level on skewed input;
+// below this depth every split is the object median, which halves the items,
+// so no tree gets deeper than BVH_SAH_DEPTH + 31 levels
+const int BVH_SAH_DEPTH = 48;
+const int BVH_STACK = 128; // traversal stack: one pending sibling per level
+
+struct SahBins
+{
+    AABB box[SAH_BINS];
+    int count[SAH_BINS];
+
+    SahBins() { fill(count, count + SAH_BINS, 0); }
+
+    void add(const SahBins &b)
+    {
+        for (int i = 0; i < SAH_BINS; i++)
+        {
+            box[i].expand(b.box[i]);
+            count[i] += b.count[i];
+        }
+    }
+};
+
+// 10 bits of each coordinate in [0, 1], interleaved
+unsigned int mortonCode(double x, double y, double z)
+{
+    unsigned int q[3] = {(unsigned int)min(1023.0, max(0.0, x * 1024)), (unsigned int)min(1023.0, max(0.0, y * 1024)),
+                         (unsigned int)min(1023.0, max(0.0, z * 1024))};
+    unsigned int code = 0;
+    for (int bit = 9; bit >= 0; bit--)
+        for (int a = 0; a < 3; a++)
+            code = code << 1 | (q[a] >> bit & 1);
+    return code;
+}
+
+struct BVH
+{
+    vector<BVHNode> nodes;
+    vector<PackedNode> packed; // replaces nodes when compressed
+    vector<int> items; // object indices, grouped by leaf
+    vector<AABB> itemBoxes;
+    vector<point> centers;      // item box centers, only while building
+    vector<unsigned int> codes; // Morton codes of items while an LBVH builds
+    int leafSize;
+    int buildThreads; // used by the last build
+    double buildSeconds, sahCost;
+
+    BVH() : leafSize(2), buildThreads(1), buildSeconds(0), sahCost(0) {}
+
+    void clear()
+    {
+        nodes.clear();
+        packed.clear();
+        items.clear();
+    }
+
+    bool empty() { return nodes.empty() && packed.empty(); }
+
+    // builder, time and SAH cost of the last build, for load messages
+    string summary()
+    {
+        stringstream ss;
+        ss << builderName(bvhBuilder) << " build " << fixed << setprecision(1) << buildSeconds * 1000 << " ms on "
+           << buildThreads << (buildThreads == 1 ? " thread" : " threads") << ", SAH cost " << setprecision(2)
+           << sahCost;
+        return ss.str();
+    }
+
+    // bytes of node storage in whichever layout is in use
+    size_t nodeBytes() { return nodes.size() * sizeof(BVHNode) + packed.size() * sizeof(PackedNode); }
+
+    // build over the given object indices; every one of them must have bounds
+    void build(const vector<Object *> &objs, const vector<int> &ids)
+    {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        clear();
+        items = ids;
+        itemBoxes.assign(objs.size(), AABB());
+        for (int i = 0; i < (int)ids.size(); i++)
+            objs[ids[i]]->getBounds(itemBoxes[ids[i]].lo, itemBoxes[ids[i]].hi);
+        buildTree();
+        buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+
+    // build over items 0 .. boxes.size() - 1 that are not Objects
+    void build(const vector<AABB> &boxes)
+    {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        clear();
+        itemBoxes = boxes;
+        items.resize(boxes.size());
+        for (int i = 0; i < (int)items.size(); i++)
+            items[i] = i;
+        buildTree();
+        buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+
+    void buildTree()
+    {
+        sahCost = 0;
+        if (items.empty())
+            return;
+        buildThreads = renderThreads > 0 ? renderThreads : max(1, (int)thread::hardware_concurrency());
+        centers.resize(itemBoxes.size());
+        for (int i = 0; i < (int)items.size(); i++)
+            centers[items[i]] = itemBoxes[items[i]].center();
+        if (bvhBuilder == BUILD_LBVH)
+            sortMorton();
+        buildNode(nodes, 0, items.size(), buildThreads, 0);
+        vector<point>().swap(centers);
+        vector<unsigned int>().swap(codes);
+        sahCost = computeSahCost();
+        if (compressedBVH)
+            pack();
+    }
+
+    // items in Morton order of their centers, codes[i] belonging to items[i]
+    void sortMorton()
+    {
+        AABB bounds;
+        for (int i = 0; i < (int)items.size(); i++)
+            bounds.expand(centers[items[i]]);
+        point extent = bounds.hi - bounds.lo;
+        double scale[3] = {extent.x > 0 ? 1 / extent.x : 0, extent.y > 0 ? 1 / extent.y : 0,
+                           extent.z > 0 ? 1 / extent.z : 0};
+        int n = items.size();
+        codes.resize(n);
+        int chunk = max(PARALLEL_BUILD_MIN, n / buildThreads + 1);
+        parallelFor((n + chunk - 1) / chunk, buildThreads, [&](int c)
+                    {
+                        for (int i = c * chunk; i < min(n, (c + 1) * chunk); i++)
+                        {
+                            point p = centers[items[i]] - bounds.lo;
+                            codes[i] = mortonCode(p.x * scale[0], p.y * scale[1], p.z * scale[2]);
+                        }
+                    });
+
+        // least significant digit radix sort, three 10-bit passes
+        vector<unsigned int> codesOut(n);
+        vector<int> itemsOut(n);
+        for (int shift = 0; shift < 30; shift += 10)
+        {
+            vector<int> start(1025, 0);
+            for (int i = 0; i < n; i++)
+                start[(codes[i] >> shift & 1023) + 1]++;
+            for (int d = 0; d < 1024; d++)
+                start[d + 1] += start[d];
+            for (int i = 0; i < n; i++)
+            {
+                int to = start[codes[i] >> shift & 1023]++;
+                codesOut[to] = codes[i];
+                itemsOut[to] = items[i];
+            }
+            codes.swap(codesOut);
+            items.swap(itemsOut);
+        }
+    }
+
+    // Nodes of the subtree over items[first, first + count) at the given
+    // depth are appended to out, root first. With threads > 1 the right child is built into its own
+    // vector on another thread and appended after the left one, so every
+    // subtree stays contiguous.
+    int buildNode(vector<BVHNode> &out, int first, int count, int threads, int depth)
+    {
+        int index = out.size();
+        out.push_back(BVHNode());
+
+        AABB box, spread;
+        for (int i = first; i < first + count; i++)
+        {
+            box.expand(itemBoxes[items[i]]);
+            spread.expand(centers[items[i]]);
+        }
+        out[index].box = box;
+        out[index].left = out[index].right = -1;
+        out[index].first = first;
+        out[index].count = count;
+        if (count <= leafSize)
+            return index;
+
+        int mid = split(first, count, spread, threads, depth);
+        int left, right;
+        if (threads > 1 && count >= PARALLEL_BUILD_MIN)
+        {
+            vector<BVHNode> rightNodes;
+            int rightThreads = threads / 2;
+            thread worker([&]
+                          { buildNode(rightNodes, mid, first + count - mid, rightThreads, depth + 1); });
+            left = buildNode(out, first, mid - first, threads - rightThreads, depth + 1);
+            worker.join();
+            right = out.size();
+            for (int i = 0; i < (int)rightNodes.size(); i++)
+            {
+                BVHNode &n = rightNodes[i];
+                if (n.left >= 0)
+                    n.left += right, n.right += right;
+                out.push_back(n);
+            }
+        }
+        else
+        {
+            left = buildNode(out, first, mid - first, 1, depth + 1);
+            right = buildNode(out, mid, first + count - mid, 1, depth + 1);
+        }
+        out[index].left = left;
+        out[index].right = right;
+        out[index].count = 0;
+        return index;
+    }
+
+    // first item of the right child; both sides are never empty
+    int split(int first, int count, AABB &spread, int threads, int depth)
+    {
+        int mid = -1;
+        if (depth < BVH_SAH_DEPTH && bvhBuilder == BUILD_SAH)
+            mid = splitSah(first, count, spread, threads);
+        else if (depth < BVH_SAH_DEPTH && bvhBuilder == BUILD_LBVH)
+            mid = splitMorton(first, count);
+        if (mid > first && mid < first + count)
+            return mid;
+
+        // object median along the widest spread of centers; also the
+        // fallback when all centers or codes coincide and for deep nodes
+        int axis = spread.longestAxis();
+        mid = first + count / 2;
+        nth_element(items.begin() + first, items.begin() + mid, items.begin() + first + count,
+                    [&](int a, int b)
+                    { return axisOf(centers[a], axis) < axisOf(centers[b], axis); });
+        return mid;
+    }
+
+    int binOf(int item, int axis, double lo, double scale)
+    {
+        return min(SAH_BINS - 1, (int)((axisOf(centers[item], axis) - lo) * scale));
+    }
+
+    // cheapest split between bins of any axis by area times count of each
+    // side; items are partitioned to match
+    int splitSah(int first, int count, AABB &spread, int threads)
+    {
+        double lo[3] = {spread.lo.x, spread.lo.y, spread.lo.z};
+        double extent[3] = {spread.hi.x - lo[0], spread.hi.y - lo[1], spread.hi.z - lo[2]};
+        double scale[3];
+        for (int a = 0; a < 3; a++)
+            scale[a] = extent[a] > 0 ? SAH_BINS / extent[a] : 0;
+
+        // big nodes are binned in slices on several threads and merged
+        int slices = count >= PARALLEL_BIN_MIN ? threads : 1;
+        SahBins local[3];
+        vector<SahBins> partial(slices > 1 ? 3 * slices : 0);
+        auto binSlice = [&](int begin, int end, SahBins *bins)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                int k = items[i];
+                const AABB &b = itemBoxes[k];
+                const point &c = centers[k];
+                double at[3] = {c.x, c.y, c.z};
+                for (int a = 0; a < 3; a++)
+                {
+                    if (scale[a] == 0)
+                        continue;
+                    int bin = min(SAH_BINS - 1, (int)((at[a] - lo[a]) * scale[a]));
+                    AABB &box = bins[a].box[bin];
+                    bins[a].count[bin]++;
+                    box.lo.x = min(box.lo.x, b.lo.x), box.lo.y = min(box.lo.y, b.lo.y), box.lo.z = min(box.lo.z, b.lo.z);
+                    box.hi.x = max(box.hi.x, b.hi.x), box.hi.y = max(box.hi.y, b.hi.y), box.hi.z = max(box.hi.z, b.hi.z);
+                }
+            }
+        };
+        if (slices == 1)
+            binSlice(first, first + count, local);
+        else
+        {
+            parallelFor(slices, slices, [&](int s)
+                        { binSlice(first + (long long)count * s / slices, first + (long long)count * (s + 1) / slices,
+                                   &partial[3 * s]); });
+            for (int s = 0; s < slices; s++)
+                for (int a = 0; a < 3; a++)
+                    local[a].add(partial[3 * s + a]);
+        }
+
+        double bestCost = 1e300;
+        int bestAxis = -1, bestBin = -1;
+        for (int a = 0; a < 3; a++)
+        {
+            if (scale[a] == 0)
+                continue;
+            SahBins &bins = local[a];
+            // right side areas and counts of the splits after bin b
+            double rightArea[SAH_BINS];
+            int rightCount[SAH_BINS];
+            AABB acc;
+            int n = 0;
+            for (int b = SAH_BINS - 1; b > 0; b--)
+            {
+                acc.expand(bins.box[b]);
+                n += bins.count[b];
+                rightArea[b - 1] = acc.area();
+                rightCount[b - 1] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < SAH_BINS - 1; b++)
+            {
+                acc.expand(bins.box[b]);
+                n += bins.count[b];
+                if (n == 0 || rightCount[b] == 0)
+                    continue;
+                double cost = acc.area() * n + rightArea[b] * rightCount[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = b;
+                }
+            }
+        }
+        if (bestAxis < 0)
+            return -1;
+        return partition(items.begin() + first, items.begin() + first + count,
+                         [&](int k)
+                         { return binOf(k, bestAxis, lo[bestAxis], scale[bestAxis]) <= bestBin; }) -
+               items.begin();
+    }
+
+    // items are in Morton order: split where the highest bit that differs
+    // across the range turns on
+    int splitMorton(int first, int count)
+    {
+        unsigned int a = codes[first], b = codes[first + count - 1];
+        if (a == b)
+            return -1;
+        unsigned int bit = 1u << (31 - __builtin_clz(a ^ b));
+        unsigned int prefix = a & ~(bit - 1) & ~bit;
+        return upper_bound(codes.begin() + first, codes.begin() + first + count, prefix | (bit - 1)) - codes.begin();
+    }
+
+    // expected cost of a random ray through the root box: one per inner
+    // node and one per leaf item, weighted by the chance of entering them
+    double computeSahCost()
+    {
+        double rootArea = nodes[0].box.area();
+        if (rootArea <= 0)
+            return items.size();
+        double cost = 0;
+        for (int i = 0; i < (int)nodes.size(); i++)
+            cost += nodes[i].box.area() / rootArea * (nodes[i].left >= 0 ? 1 : nodes[i].count);
+        return cost;
+    }
+
+    // convert the binary nodes to the packed layout and drop them; trees the
+    // packed layout cannot hold (huge leaves or boxes beyond float range)
+    // stay binary
+    void pack()
+    {
+        if (nodes.empty() || leafSize > PACKED_MAX_LEAF || (int)items.size() >= PACKED_MAX_ITEMS)
+            return;
+        AABB &root = nodes[0].box;
+        const double limit = 1e37;
+        if (!(root.lo.x > -limit && root.lo.y > -limit && root.lo.z > -limit && root.hi.x < limit &&
+              root.hi.y < limit && root.hi.z < limit))
+            return;
+        packed.reserve(nodes.size() / 2 + 1);
+        packNode(0);
+        vector<BVHNode>().swap(nodes);
+    }
+
+    // packed node for the subtree of binary node n; returns its index
+    int packNode(int n)
+    {
+        // open the largest inner children until there are four
+        int slots[4] = {n, -1, -1, -1};
+        int used = 1;
+        if (nodes[n].left >= 0)
+        {
+            slots[0] = nodes[n].left;
+            slots[1] = nodes[n].right;
+            used = 2;
+        }
+        while (used < 4)
+        {
+            int widest = -1;
+            for (int s = 0; s < used; s++)
+                if (nodes[slots[s]].left >= 0 && (widest < 0 || nodes[slots[s]].box.area() > nodes[slots[widest]].box.area()))
+                    widest = s;
+            if (widest < 0)
+                break;
+            int open = slots[widest];
+            slots[widest] = nodes[open].left;
+            slots[used++] = nodes[open].right;
+        }
+
+        int index = packed.size();
+        packed.push_back(PackedNode());
+        PackedNode node;
+        AABB &box = nodes[n].box;
+        double lo[3] = {box.lo.x, box.lo.y, box.lo.z}, hi[3] = {box.hi.x, box.hi.y, box.hi.z};
+        for (int a = 0; a < 3; a++)
+        {
+            float origin = (float)lo[a];
+            if (origin > lo[a])
+                origin = nextafterf(origin, -INFINITY);
+            float scale = max((float)((hi[a] - origin) / 255), FLT_MIN);
+            node.origin[a] = origin;
+            node.scale[a] = scale;
+            while (packedBound(node, a, 255) < hi[a])
+                node.scale[a] = nextafterf(node.scale[a], INFINITY);
+        }
+
+        for (int c = 0; c < 4; c++)
+        {
+            node.child[c] = PACKED_EMPTY;
+            for (int a = 0; a < 3; a++)
+                node.lo[a][c] = node.hi[a][c] = 0;
+            if (c >= used)
+                continue;
+            AABB &b = nodes[slots[c]].box;
+            double clo[3] = {b.lo.x, b.lo.y, b.lo.z}, chi[3] = {b.hi.x, b.hi.y, b.hi.z};
+            for (int a = 0; a < 3; a++)
+            {
+                int qlo = (int)max(0.0, min(255.0, floor((clo[a] - node.origin[a]) / node.scale[a])));
+                while (qlo > 0 && packedBound(node, a, qlo) > clo[a])
+                    qlo--;
+                int qhi = (int)max(0.0, min(255.0, ceil((chi[a] - node.origin[a]) / node.scale[a])));
+                while (qhi < 255 && packedBound(node, a, qhi) < chi[a])
+                    qhi++;
+                node.lo[a][c] = qlo;
+                node.hi[a][c] = qhi;
+            }
+        }
+        // children after the parent is stored: the vector may grow under them
+        for (int c = 0; c < used; c++)
+        {
+            BVHNode &child = nodes[slots[c]];
+            node.child[c] = child.left < 0 ? packedLeaf(child.first, child.count) : packNode(slots[c]);
+        }
+        packed[index] = node;
+        return index;
+    }
+
+    // call leaf(item) for every item in a leaf the ray's interval reaches; it
+    // may shrink ray.tmax to skip the rest of the tree behind a hit, and
+    // returns true to stop the walk, which then returns true as well
+    template <class Leaf>
+    bool traverse(Ray &ray, Leaf leaf)
+    {
+        if (!packed.empty())
+            return traversePacked(ray, leaf);
+        if (nodes.empty())
+            return false;
+        point inv(1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z);
+        int stack[BVH_STACK];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            BVHNode &node = nodes[stack[--top]];
+            if (!node.box.hit(ray.origin, inv, ray.tmin, ray.tmax))
+                continue;
+            if (node.left < 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    if (leaf(items[i]))
+                        return true;
+                continue;
+            }
+            assert(top + 2 <= BVH_STACK);
+            stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        return false;
+    }
+
+    // the packed walk visits a node's children nearest entry first and drops
+    // any whose entry is already behind ray.tmax when it comes off the stack
+    template <class Leaf>
+    bool traversePacked(Ray &ray, Leaf leaf)
+    {
+        double o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        double inv[3] = {1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z};
+        unsigned int stack[3 * BVH_STACK];
+        double entry[3 * BVH_STACK];
+        int top = 0;
+        stack[top] = 0;
+        entry[top++] = ray.tmin;
+        while (top > 0)
+        {
+            top--;
+            unsigned int ref = stack[top];
+            if (entry[top] > ray.tmax)
+                continue;
+            if (ref & PACKED_LEAF)
+            {
+                int first = ref & (PACKED_MAX_ITEMS - 1), count = (ref >> 27) & 15;
+                for (int i = first; i < first + count; i++)
+                    if (leaf(items[i]))
+                        return true;
+                continue;
+            }
+
+            const PackedNode &node = packed[ref];
+            unsigned int hitRef[4];
+            double hitNear[4];
+            int hits = 0;
+            double near[4];
+            int mask = packedHits(node, o, inv, ray.tmin, ray.tmax, near);
+            for (int c = 0; c < 4 && node.child[c] != PACKED_EMPTY; c++)
+            {
+                if (!(mask >> c & 1))
+                    continue;
+                double t0 = near[c];
+                // insertion by entry distance, farthest first
+                int k = hits++;
+                for (; k > 0 && hitNear[k - 1] < t0; k--)
+                {
+                    hitNear[k] = hitNear[k - 1];
+                    hitRef[k] = hitRef[k - 1];
+                }
+                hitNear[k] = t0;
+                hitRef[k] = node.child[c];
+            }
+            assert(top + hits <= 3 * BVH_STACK);
+            for (int k = 0; k < hits; k++)
+            {
+                stack[top] = hitRef[k];
+                entry[top++] = hitNear[k];
+            }
+        }
+        return false;
+    }
+
+    // nearest hit in the ray's interval, which shrinks to it; ties go to the
+    // lower object index like a linear scan
+    void nearest(const vector<Object *> &objs, Ray &ray, double &tBest, int &best)
+    {
+        point col;
+        traverse(ray, [&](int k)
+                 {
+                     double t = objs[k]->intersect_shapes(ray, col);
+                     if (t > 0 && (best == -1 || t < tBest || (t == tBest && k < best)))
+                     {
+                         tBest = ray.tmax = t;
+                         best = k;
+                     }
+                     return false;
+                 });
+    }
+
+    // append the objects whose boxes overlap the frustum; false as soon as
+    // there are more than limit of them
+    bool collect(Frustum &frustum, vector<int> &out, int limit)
+    {
+        if (!packed.empty())
+            return collectPacked(frustum, out, limit);
+        if (nodes.empty())
+            return true;
+        int stack[BVH_STACK];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            BVHNode &node = nodes[stack[--top]];
+            if (!frustum.overlaps(node.box))
+                continue;
+            if (node.left < 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    if (frustum.overlaps(itemBoxes[items[i]]))
+                    {
+                        out.push_back(items[i]);
+                        if ((int)out.size() > limit)
+                            return false;
+                    }
+                continue;
+            }
+            assert(top + 2 <= BVH_STACK);
+            stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        return true;
+    }
+
+    bool collectPacked(Frustum &frustum, vector<int> &out, int limit)
+    {
+        unsigned int stack[3 * BVH_STACK];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            unsigned int ref = stack[--top];
+            if (ref & PACKED_LEAF)
+            {
+                int first = ref & (PACKED_MAX_ITEMS - 1), count = (ref >> 27) & 15;
+                for (int i = first; i < first + count; i++)
+                    if (frustum.overlaps(itemBoxes[items[i]]))
+                    {
+                        out.push_back(items[i]);
+                        if ((int)out.size() > limit)
+                            return false;
+                    }
+                continue;
+            }
+            const PackedNode &node = packed[ref];
+            for (int c = 3; c >= 0; c--)
+            {
+                if (node.child[c] == PACKED_EMPTY)
+                    continue;
+                AABB box(point(packedBound(node, 0, node.lo[0][c]), packedBound(node, 1, node.lo[1][c]),
+                               packedBound(node, 2, node.lo[2][c])),
+                         point(packedBound(node, 0, node.hi[0][c]), packedBound(node, 1, node.hi[1][c]),
+                               packedBound(node, 2, node.hi[2][c])));
+                if (frustum.overlaps(box))
+                {
+                    assert(top < 3 * BVH_STACK);
+                    stack[top++] = node.child[c];
+                }
+            }
+        }
+        return true;
+    }
+
+    // any object with a hit in (0, dist - 1e-5); ray.tmax must be at most dist
+    bool occluded(const vector<Object *> &objs, Ray &ray, double dist)
+    {
+        point col;
+        return traverse(ray, [&](int k)
+                        {
+                            double t = objs[k]->intersect_shapes(ray, col);
+                            return t > 0 && t + 1e-5 < dist;
+                        });
+    }
+};
+
+// the acceleration structure for the global object list
+struct SceneAccel
+{
+    BVH bvh;
+    vector<int> unbounded; // analytic primitives tested outside the tree
+
+    void build(const vector<Object *> &objs)
+    {
+        vector<int> all;
+        for (int i = 0; i < (int)objs.size(); i++)
+            all.push_back(i);
+        build(objs, all);
+    }
+
+    // only the listed objects
+    void build(const vector<Object *> &objs, const vector<int> &ids)
+    {
+        vector<int> bounded;
+        unbounded.clear();
+        for (int i = 0; i < (int)ids.size(); i++)
+        {
+            point lo, hi;
+            if (objs[ids[i]]->getBounds(lo, hi))
+                bounded.push_back(ids[i]);
+            else
+                unbounded.push_back(ids[i]);
+        }
+        bvh.build(objs, bounded);
+        // every object gets a box for nearestAmong; unbounded ones an endless one
+        for (int i = 0; i < (int)unbounded.size(); i++)
+            bvh.itemBoxes[unbounded[i]] = AABB(point(-1e300, -1e300, -1e300), point(1e300, 1e300, 1e300));
+    }
+};
+
+// Conservative box-versus-cone test: the box's bounding sphere against the
+// cone with apex at the light, unit axis and half angle in radians.
+bool boxTouchesCone(const AABB &box, point apex, point axis, double halfAngle)
+{
+    AABB b = box;
+    point v = b.center() - apex;
+    double radius = (b.hi - b.lo).length() * 0.5 + 1e-6;
+    double d = v.length();
+    if (d <= radius)
+        return true;
+    double angle = acos(max(-1.0, min(1.0, (v * axis) / d)));
+    return angle - asin(radius / d) <= halfAngle + 1e-6;
+}
+
+SceneAccel sceneAccel;
+
+// A shadow ray of a spot light only runs when its target lies inside the
+// cone, and the whole segment back to the apex stays inside it, so only
+// objects touching the cone can occlude. Each spot light gets a BVH of
+// those; point lights see in every direction and use sceneAccel.
+vector<SceneAccel> spotOccluders;
+
+void buildSpotOccluders(const vector<Object *> &objs, vector<SceneAccel> &accels)
+{
+    accels.assign(spot_lights.size(), SceneAccel());
+    for (int s = 0; s < (int)spot_lights.size(); s++)
+    {
+        SpotLight &light = spot_lights[s];
+        double halfAngle = min(180.0, fabs(light.cutoffAngle)) * M_PI / 180.0;
+        vector<int> ids;
+        for (int i = 0; i < (int)objs.size(); i++)
+        {
+            AABB box;
+            if (!objs[i]->getBounds(box.lo, box.hi) ||
+                boxTouchesCone(box, light.pointLight.pos, light.unitDir, halfAngle))
+                ids.push_back(i);
+        }
+        accels[s].build(objs, ids);
+    }
+}
+
+void buildAcceleration()
+{
+    sceneAccel.build(objects);
+    buildSpotOccluders(objects, spotOccluders);
+    cout << "Scene BVH: " << objects.size() << " objects, " << sceneAccel.bvh.summary() << endl;
+}
+
+// The object list and acceleration structure a thread traces against.
+// Render pool threads on other NUMA nodes point this at a local replica.
+struct SceneView
+{
+    vector<Object *> *objects;
+    SceneAccel *accel;
+    vector<SceneAccel> *spotAccels;
+};
+
+thread_local SceneView activeScene = {&objects, &sceneAccel, &spotOccluders};
+
+Object *sceneObject(int index)
+{
+    return (*activeScene.objects)[index];
+}
+
+// nearest hit in the ray's interval
+int nearestObject(Ray ray, double &tHit)
+{
+    vector<Object *> &objs = *activeScene.objects;
+    SceneAccel &accel = *activeScene.accel;
+    int best = -1;
+    tHit = -1;
+    point col;
+    for (int i = 0; i < (int)accel.unbounded.size(); i++)
+    {
+        int k = accel.unbounded[i];
+        double t = objs[k]->intersect_shapes(ray, col);
+        if (t > 0 && (best == -1 || t < tHit || (t == tHit && k < best)))
+        {
+            tHit = ray.tmax = t;
+            best = k;
+        }
+    }
+    accel.bvh.nearest(objs, ray, tHit, best);
+    return best;
+}
+
+// objects that can be hit by rays inside the frustum, in index order; false
+// if there are more than limit, where the BVH is the better filter
+bool visibleObjects(Frustum &frustum, vector<int> &ids, int limit)
+{
+    vector<Object *> &objs = *activeScene.objects;
+    SceneAccel &accel = *activeScene.accel;
+    ids.clear();
+    for (int i = 0; i < (int)accel.unbounded.size(); i++)
+    {
+        AABB box;
+        if (!objs[accel.unbounded[i]]->getExtent(box.lo, box.hi) || frustum.overlaps(box))
+            ids.push_back(accel.unbounded[i]);
+    }
+    if (!accel.bvh.collect(frustum, ids, limit))
+        return false;
+    sort(ids.begin(), ids.end());
+    return true;
+}
+
+// nearestObject restricted to ids (ascending), same tie breaking
+int nearestAmong(const vector<int> &ids, Ray ray, double &tHit)
+{
+    vector<Object *> &objs = *activeScene.objects;
+    vector<AABB> &boxes = activeScene.accel->bvh.itemBoxes;
+    point inv(1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z);
+    int best = -1;
+    tHit = -1;
+    point col;
+    for (int i = 0; i < (int)ids.size(); i++)
+    {
+        if (!boxes[ids[i]].hit(ray.origin, inv, ray.tmin, ray.tmax))
+            continue;
+        double t = objs[ids[i]]->intersect_shapes(ray, col);
+        if (t > 0 && (best == -1 || t < tHit))
+        {
+            tHit = ray.tmax = t;
+            best = ids[i];
+        }
+    }
+    return best;
+}
+
+// ray starts at the light and travels dist to reach target; spot is the
+// index of the spot light casting it, -1 for point lights. Primitives reject
+// hits past dist; the 1e-5 margin is applied to what they return.
+bool isOccluded(Ray ray, double dist, point target, int spot)
+{
+    ray.tmax = min(ray.tmax, dist);
+    vector<Object *> &objs = *activeScene.objects;
+    SceneAccel &accel = spot < 0 ? *activeScene.accel : (*activeScene.spotAccels)[spot];
+    point col;
+    for (int i = 0; i < (int)accel.unbounded.size(); i++)
+    {
+        Object *o = objs[accel.unbounded[i]];
+        if (!o->canOcclude(ray.origin, target))
+            continue;
+        double t = o->intersect_shapes(ray, col);
+        if (t > 0 && t + 1e-5 < dist)
+            return true;
+    }
+    return accel.bvh.occluded(objs, ray, dist);
+}
@@ -0,0 +1,272 @@
+// Micro benchmarks run from the command line (--bench-*). Hardware cache
+// counters come from perf_event_open on Linux and read "n/a" elsewhere or
+// when the kernel does not allow them.
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+extern TileOrder renderOrder;
+
+struct PerfCounter
+{
+    int fd;
+
+    PerfCounter(unsigned int type, unsigned long long config) : fd(-1)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~PerfCounter()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // -1 when the counter is unavailable
+    long long stop()
+    {
+#ifdef __linux__
+        long long value;
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &value, sizeof(value)) == sizeof(value))
+                return value;
+        }
+#endif
+        return -1;
+    }
+};
+
+string counterText(long long value)
+{
+    return value < 0 ? string("n/a") : to_string(value);
+}
+
+// render the current scene once per tile/pixel ordering and compare them
+void benchOrders()
+{
+    TileOrder saved = renderOrder;
+    cout << left << setw(10) << "order" << setw(12) << "seconds" << setw(16) << "cache-misses"
+         << setw(16) << "L1d-misses" << "LLC-misses" << endl;
+    for (int o = ORDER_SCANLINE; o <= ORDER_HILBERT; o++)
+    {
+        renderOrder = (TileOrder)o;
+#ifdef __linux__
+        PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        PerfCounter l1d(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        PerfCounter llc(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+        PerfCounter misses(0, 0), l1d(0, 0), llc(0, 0);
+#endif
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        misses.start();
+        l1d.start();
+        llc.start();
+        renderFrame();
+        long long m = misses.stop(), a = l1d.stop(), b = llc.stop();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << left << setw(10) << orderName(renderOrder) << setw(12) << fixed << setprecision(3) << seconds
+             << setw(16) << counterText(m) << setw(16) << counterText(a) << counterText(b) << endl;
+    }
+    renderOrder = saved;
+}
+
+// resident set size in KiB, -1 if unknown
+long long residentKiB()
+{
+#ifdef __linux__
+    ifstream in("/proc/self/statm");
+    long long pages, resident;
+    if (in >> pages >> resident)
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+    return -1;
+}
+
+extern SceneArena sceneArena;
+
+// load the scene count times in this process; memory should stay flat
+void benchLoad(int count)
+{
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    for (int i = 1; i <= count; i++)
+    {
+        reloadScene();
+        if (i == 1 || i == count || i % max(1, count / 10) == 0)
+            cout << "load " << i << ": " << objects.size() << " objects, arena " << sceneArena.bytesUsed()
+                 << " bytes in " << sceneArena.blocks.size() << " blocks, RSS " << counterText(residentKiB()) << " KiB" << endl;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << fixed << setprecision(3) << 1000.0 * seconds / max(1, count) << " ms per load" << endl;
+}
+
+extern Framebuffer framebuffer;
+extern double exposure;
+void bindShadingKernels();
+
+// time the exact and --fast-math kernels on the current scene (best of runs
+// renders each) and measure the error of the approximations; false if PSNR
+// drops below minPsnr
+bool benchMath(double minPsnr, int runs = 3)
+{
+    bool saved = fastMath;
+    bitmap_image images[2];
+    double seconds[2] = {1e300, 1e300};
+    for (int run = 0; run < runs; run++)
+        for (int fast = 0; fast < 2; fast++)
+        {
+            fastMath = fast;
+            bindShadingKernels();
+            chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+            renderFrame();
+            seconds[fast] = min(seconds[fast], chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+            images[fast] = bitmap_image(framebuffer.width, framebuffer.height);
+            quantize(framebuffer, images[fast], exposure);
+        }
+    fastMath = saved;
+    bindShadingKernels();
+
+    const unsigned char *a = images[0].data(), *b = images[1].data();
+    int maxError = 0;
+    long long differing = 0;
+    for (unsigned int i = 0; i < images[0].pixel_count() * 3; i++)
+    {
+        int e = abs((int)a[i] - (int)b[i]);
+        maxError = max(maxError, e);
+        differing += e != 0;
+    }
+    double psnr = images[0].psnr(images[1]);
+    bool pass = psnr >= minPsnr;
+    cout << objects.size() << " objects, " << normal_lights.size() << " point lights, " << spot_lights.size()
+         << " spot lights" << endl;
+    cout << fixed << setprecision(3) << "exact " << seconds[0] << " s, fast " << seconds[1] << " s, speedup "
+         << seconds[0] / max(1e-9, seconds[1]) << "x" << endl;
+    cout << setprecision(2) << "PSNR ";
+    if (psnr >= 1000000.0)
+        cout << "inf";
+    else
+        cout << psnr;
+    cout << " dB, max channel error "
+         << maxError << "/255, " << differing << " channels differ -> " << (pass ? "ok" : "FAIL") << " (min "
+         << minPsnr << " dB)" << endl;
+    return pass;
+}
+
+// every hierarchy of the scene: the top level, the spot light occluders and
+// each prototype once
+vector<BVH *> sceneHierarchies()
+{
+    vector<BVH *> trees(1, &sceneAccel.bvh);
+    for (int s = 0; s < (int)spotOccluders.size(); s++)
+        trees.push_back(&spotOccluders[s].bvh);
+    vector<Prototype *> seen;
+    for (int i = 0; i < (int)objects.size(); i++)
+    {
+        Instance *inst = dynamic_cast<Instance *>(objects[i]);
+        if (inst != NULL && find(seen.begin(), seen.end(), inst->proto) == seen.end())
+        {
+            seen.push_back(inst->proto);
+            trees.push_back(&inst->proto->accel.bvh);
+        }
+    }
+    return trees;
+}
+
+struct BvhVariant
+{
+    BVHBuilder builder;
+    bool compressed;
+};
+
+// build the scene with each builder and layout and compare build time (all
+// hierarchies), SAH cost of the largest one, node memory, primary rays per
+// second (best of runs passes over every pixel on this thread) and a full
+// render; the hits of every variant must agree
+void benchBvh(int runs = 3)
+{
+    const BvhVariant variants[] = {{BUILD_MEDIAN, false}, {BUILD_SAH, false}, {BUILD_LBVH, false}, {BUILD_SAH, true}};
+    BVHBuilder savedBuilder = bvhBuilder;
+    bool savedCompressed = compressedBVH;
+    vector<int> reference;
+    cout << left << setw(9) << "builder" << setw(12) << "layout" << setw(11) << "build ms" << setw(11) << "SAH cost"
+         << setw(12) << "nodes KiB" << setw(10) << "Mrays/s" << setw(9) << "frame s" << "hits" << endl;
+    for (int v = 0; v < (int)(sizeof(variants) / sizeof(variants[0])); v++)
+    {
+        bvhBuilder = variants[v].builder;
+        compressedBVH = variants[v].compressed;
+        reloadScene();
+        setupCamera();
+        vector<BVH *> trees = sceneHierarchies();
+        double buildSeconds = 0;
+        size_t bytes = 0;
+        BVH *largest = trees[0];
+        for (int t = 0; t < (int)trees.size(); t++)
+        {
+            buildSeconds += trees[t]->buildSeconds;
+            bytes += trees[t]->nodeBytes();
+            if (trees[t]->items.size() > largest->items.size())
+                largest = trees[t];
+        }
+
+        vector<int> ids(pixel_size * pixel_size);
+        double best = 1e300;
+        for (int run = 0; run < runs; run++)
+        {
+            chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+            for (int j = 0; j < pixel_size; j++)
+                for (int i = 0; i < pixel_size; i++)
+                {
+                    double t;
+                    ids[j * pixel_size + i] = nearestObject(primaryRay(pixelDirection(i, j)), t);
+                }
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+        }
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        renderFrame();
+        double frame = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+        if (v == 0)
+            reference = ids;
+        long long differ = 0;
+        for (int k = 0; k < (int)ids.size(); k++)
+            differ += ids[k] != reference[k];
+        cout << left << setw(9) << builderName(bvhBuilder) << setw(12) << (compressedBVH ? "compressed" : "full")
+             << fixed << setprecision(1) << setw(11) << buildSeconds * 1000 << setprecision(2) << setw(11)
+             << largest->sahCost << setprecision(1) << setw(12) << bytes / 1024.0 << setprecision(3) << setw(10)
+             << ids.size() / best / 1e6 << setw(9) << frame
+             << (v == 0 ? string("reference") : differ == 0 ? string("same") : to_string(differ) + " differ") << endl;
+    }
+    bvhBuilder = savedBuilder;
+    compressedBVH = savedCompressed;
+    reloadScene();
+}
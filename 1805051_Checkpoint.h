@@ -0,0 +1,185 @@
+// Crash-safe progress for long renders (--checkpoint FILE). Every finished
+// tile is appended to a journal together with its pixels, and the journal is
+// flushed to disk every few seconds. A render started again with the same
+// scene, camera and settings reads the journal back and only traces the
+// tiles missing from it. A record torn by a crash is cut off on resume.
+
+#include <cstdio>
+#include <filesystem>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+const unsigned int JOURNAL_MAGIC = 0x4b435452; // "RTCK"
+
+struct JournalHeader
+{
+    unsigned int magic;
+    int version;
+    int width, height;
+    unsigned long long hash; // scene, camera and settings, see renderHash()
+};
+
+struct JournalRecord
+{
+    int id, x0, y0, x1, y1; // followed by the tile's floats, row-major RGB
+};
+
+struct TileJournal
+{
+    FILE *file;
+    string path;
+    JournalHeader header;
+    mutex lock;
+    chrono::steady_clock::time_point lastFlush;
+    double flushSeconds;
+
+    TileJournal() : file(NULL), flushSeconds(5) {}
+
+    ~TileJournal() { close(); }
+
+    bool valid(const JournalRecord &r)
+    {
+        return r.id >= 0 && r.x0 >= 0 && r.y0 >= 0 && r.x0 < r.x1 && r.y0 < r.y1 && r.x1 <= header.width &&
+               r.y1 <= header.height;
+    }
+
+    // Open fileName for a width x height render with the given hash and list
+    // the tiles it already holds. A journal of a different render is
+    // started over. False if the file cannot be written.
+    bool open(const string &fileName, unsigned long long hash, int width, int height, vector<int> &done)
+    {
+        close();
+        path = fileName;
+        done.clear();
+        JournalHeader wanted = {JOURNAL_MAGIC, 1, width, height, hash};
+        header = wanted;
+
+        unsigned long long good = 0;
+        FILE *in = fopen(fileName.c_str(), "rb");
+        if (in != NULL)
+        {
+            JournalHeader h;
+            if (fread(&h, sizeof(h), 1, in) == 1 && h.magic == wanted.magic && h.version == wanted.version &&
+                h.width == width && h.height == height && h.hash == hash)
+            {
+                // offsets kept by hand; journals of big frames pass 2 GB
+                unsigned long long size = filesystem::file_size(fileName);
+                unsigned long long offset = sizeof(h);
+                good = offset;
+                JournalRecord r;
+                while (fread(&r, sizeof(r), 1, in) == 1 && valid(r))
+                {
+                    long bytes = (long)(r.x1 - r.x0) * (r.y1 - r.y0) * 3 * sizeof(float);
+                    offset += sizeof(r) + bytes;
+                    if (offset > size || fseek(in, bytes, SEEK_CUR) != 0)
+                        break;
+                    good = offset;
+                    done.push_back(r.id);
+                }
+            }
+            fclose(in);
+        }
+
+        if (good > 0)
+        {
+            filesystem::resize_file(fileName, good);
+            file = fopen(fileName.c_str(), "ab");
+        }
+        else
+        {
+            file = fopen(fileName.c_str(), "wb");
+            if (file != NULL)
+                fwrite(&header, sizeof(header), 1, file);
+        }
+        if (file == NULL)
+        {
+            cout << "Unable to write checkpoint " << fileName << endl;
+            return false;
+        }
+        lastFlush = chrono::steady_clock::now();
+        return true;
+    }
+
+    // called from any render thread
+    void append(const Tile &tile, const float *rgb)
+    {
+        lock_guard<mutex> guard(lock);
+        if (file == NULL)
+            return;
+        JournalRecord r = {tile.id, tile.x0, tile.y0, tile.x1, tile.y1};
+        fwrite(&r, sizeof(r), 1, file);
+        fwrite(rgb, sizeof(float), tile.pixelCount() * 3, file);
+        if (chrono::duration<double>(chrono::steady_clock::now() - lastFlush).count() >= flushSeconds)
+            flushLocked();
+    }
+
+    void flushLocked()
+    {
+        fflush(file);
+#ifndef _WIN32
+        fsync(fileno(file));
+#endif
+        lastFlush = chrono::steady_clock::now();
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        if (file == NULL)
+            return;
+        flushLocked();
+        fclose(file);
+        file = NULL;
+    }
+
+    // copy every journaled tile into fb
+    bool restore(Framebuffer &fb)
+    {
+        close();
+        FILE *in = fopen(path.c_str(), "rb");
+        if (in == NULL)
+            return false;
+        JournalHeader h;
+        bool ok = fread(&h, sizeof(h), 1, in) == 1;
+        JournalRecord r;
+        vector<float> rgb;
+        while (ok && fread(&r, sizeof(r), 1, in) == 1 && valid(r))
+        {
+            Tile t(r.id, r.x0, r.y0, r.x1, r.y1);
+            rgb.resize(t.pixelCount() * 3);
+            if (fread(rgb.data(), sizeof(float), rgb.size(), in) != rgb.size())
+                break;
+            storeTile(fb, t, rgb.data());
+        }
+        fclose(in);
+        return ok;
+    }
+
+    // the render completed; the journal is no longer needed
+    void discard()
+    {
+        close();
+        if (path != "")
+            remove(path.c_str());
+    }
+};
+
+TileJournal journal;
+
+void journalTile(const Tile &tile, const float *rgb)
+{
+    journal.append(tile, rgb);
+}
+
+// FNV-1a, for renderHash()
+unsigned long long hashBytes(const void *data, size_t size, unsigned long long h = 1469598103934665603ULL)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,206 @@
+// Edge-aware denoising of the float framebuffer (--denoise N). After the
+// frame is traced, one extra primary ray per pixel records the normal, hit
+// distance and object of what the pixel sees. N passes of the a-trous
+// wavelet filter (5x5 B3 spline, taps 1, 2, 4, ... pixels apart) then
+// average each pixel with neighbours that agree in color, normal, depth and
+// object, so noise from --roulette is smoothed without blurring edges,
+// shadow boundaries or the floor's checkers. Planes are stored one channel
+// per array so the tap loop runs four pixels per SSE2 step; rows are split
+// across threads.
+
+extern int renderThreads;
+
+// edge-stopping parameters besides the color sigma
+const float DENOISE_SIGMA_DEPTH = 0.002f; // relative hit distance per tap step
+const int DENOISE_NORMAL_POWER_LOG2 = 7;  // weight = max(0, n.n')^128
+
+// per-pixel primary-hit features of a window of the frame, one plane each
+struct GuideBuffer
+{
+    int width, height;
+    vector<float> nx, ny, nz, depth;
+    vector<int> material; // object index, -1 for sky
+
+    GuideBuffer() : width(0), height(0) {}
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        nx.assign(w * h, 0.0f);
+        ny.assign(w * h, 0.0f);
+        nz.assign(w * h, 0.0f);
+        depth.assign(w * h, 0.0f);
+        material.assign(w * h, -1);
+    }
+};
+
+// fill g for the pixels of window (setupCamera must have run)
+void buildGuides(GuideBuffer &g, const Tile &window, int threads)
+{
+    g.resize(window.width(), window.height());
+    parallelFor(g.height, threads, [&](int y)
+                {
+                    for (int x = 0; x < g.width; x++)
+                    {
+                        int k = y * g.width + x;
+                        Ray ray = primaryRay(pixelDirection(window.x0 + x, window.y0 + y));
+                        double t;
+                        int id = nearestObject(ray, t);
+                        // sky faces the eye so sky pixels agree with each other
+                        point n = -ray.dir;
+                        if (id != -1)
+                            n = sceneObject(id)->getNormal(ray.origin + ray.dir * t, ray).dir;
+                        g.nx[k] = n.x, g.ny[k] = n.y, g.nz[k] = n.z;
+                        g.depth[k] = id != -1 ? t : 0.0f;
+                        g.material[k] = id;
+                    }
+                });
+}
+
+// the filter's per-pixel inputs for one pass
+struct AtrousPlanes
+{
+    const float *r, *g, *b;          // color in displayed units
+    const float *nx, *ny, *nz, *depth;
+    const int *material;
+    int width, height;
+};
+
+// weight of tap q for pixel p
+inline float atrousWeight(const AtrousPlanes &in, int p, int q, float kernel, float colorScale, float depthScale)
+{
+    if (in.material[p] != in.material[q])
+        return 0.0f;
+    float dr = in.r[p] - in.r[q], dg = in.g[p] - in.g[q], db = in.b[p] - in.b[q];
+    float wc = fastExpNeg(-(dr * dr + dg * dg + db * db) * colorScale);
+    float n = max(0.0f, in.nx[p] * in.nx[q] + in.ny[p] * in.ny[q] + in.nz[p] * in.nz[q]);
+    for (int s = 0; s < DENOISE_NORMAL_POWER_LOG2; s++)
+        n *= n;
+    float wz = fastExpNeg(-fabs(in.depth[p] - in.depth[q]) * depthScale / (in.depth[p] + 1e-6f));
+    return kernel * wc * n * wz;
+}
+
+// accumulate the weighted taps of row y into sum (r, g, b and weight
+// planes of the row's width); taps are step pixels apart
+void atrousRow(const AtrousPlanes &in, int y, int step, float colorScale, float *sum)
+{
+    static const float h[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    const int w = in.width, row = y * w;
+    const float depthScale = 1.0f / (DENOISE_SIGMA_DEPTH * step);
+    float *sr = sum, *sg = sum + w, *sb = sum + 2 * w, *sw = sum + 3 * w;
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        int qy = y + dy * step;
+        if (qy < 0 || qy >= in.height)
+            continue;
+        for (int dx = -2; dx <= 2; dx++)
+        {
+            const int shift = dx * step;
+            const int x1 = min(w, w - shift);
+            const float kernel = h[dy + 2] * h[dx + 2];
+            const int q0 = qy * w + shift;
+            int x = max(0, -shift);
+#ifdef BITMAP_IMAGE_SSE2
+            // four pixels of the row against four taps at once
+            const __m128 vKernel = _mm_set1_ps(kernel), vColor = _mm_set1_ps(-colorScale);
+            const __m128 vDepth = _mm_set1_ps(-depthScale), vEps = _mm_set1_ps(1e-6f), zero = _mm_setzero_ps();
+            const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+            for (; x + 4 <= x1; x += 4)
+            {
+                int p = row + x, q = q0 + x;
+                __m128 rq = _mm_loadu_ps(in.r + q), gq = _mm_loadu_ps(in.g + q), bq = _mm_loadu_ps(in.b + q);
+                __m128 dr = _mm_sub_ps(_mm_loadu_ps(in.r + p), rq);
+                __m128 dg = _mm_sub_ps(_mm_loadu_ps(in.g + p), gq);
+                __m128 db = _mm_sub_ps(_mm_loadu_ps(in.b + p), bq);
+                __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                __m128 weight = _mm_mul_ps(vKernel, fastExpNeg4(_mm_mul_ps(d2, vColor)));
+
+                __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in.nx + p), _mm_loadu_ps(in.nx + q)),
+                                                 _mm_mul_ps(_mm_loadu_ps(in.ny + p), _mm_loadu_ps(in.ny + q))),
+                                      _mm_mul_ps(_mm_loadu_ps(in.nz + p), _mm_loadu_ps(in.nz + q)));
+                n = _mm_max_ps(n, zero);
+                for (int s = 0; s < DENOISE_NORMAL_POWER_LOG2; s++)
+                    n = _mm_mul_ps(n, n);
+                weight = _mm_mul_ps(weight, n);
+
+                __m128 zp = _mm_loadu_ps(in.depth + p);
+                __m128 dz = _mm_and_ps(_mm_sub_ps(zp, _mm_loadu_ps(in.depth + q)), absMask);
+                weight = _mm_mul_ps(weight, fastExpNeg4(_mm_div_ps(_mm_mul_ps(dz, vDepth), _mm_add_ps(zp, vEps))));
+
+                __m128i same = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(in.material + p)),
+                                               _mm_loadu_si128((const __m128i *)(in.material + q)));
+                weight = _mm_and_ps(weight, _mm_castsi128_ps(same));
+
+                _mm_storeu_ps(sr + x, _mm_add_ps(_mm_loadu_ps(sr + x), _mm_mul_ps(weight, rq)));
+                _mm_storeu_ps(sg + x, _mm_add_ps(_mm_loadu_ps(sg + x), _mm_mul_ps(weight, gq)));
+                _mm_storeu_ps(sb + x, _mm_add_ps(_mm_loadu_ps(sb + x), _mm_mul_ps(weight, bq)));
+                _mm_storeu_ps(sw + x, _mm_add_ps(_mm_loadu_ps(sw + x), weight));
+            }
+#endif
+            for (; x < x1; x++)
+            {
+                int q = q0 + x;
+                float weight = atrousWeight(in, row + x, q, kernel, colorScale, depthScale);
+                sr[x] += weight * in.r[q];
+                sg[x] += weight * in.g[q];
+                sb[x] += weight * in.b[q];
+                sw[x] += weight;
+            }
+        }
+    }
+}
+
+// denoise window of fb in place with the given number of passes; scale maps
+// radiance to displayed units (the exposure), sigma is the color difference
+// in those units that still averages, halved after every pass
+void denoise(Framebuffer &fb, const GuideBuffer &g, const Tile &window, int passes, float sigma, float scale,
+             int threads)
+{
+    int w = window.width(), hgt = window.height();
+    vector<float> planes[6];
+    for (int c = 0; c < 6; c++)
+        planes[c].resize(w * hgt);
+    for (int y = 0; y < hgt; y++)
+        for (int x = 0; x < w; x++)
+        {
+            float *p = fb.pixel(window.x0 + x, window.y0 + y);
+            for (int c = 0; c < 3; c++)
+                planes[c][y * w + x] = p[c] * scale;
+        }
+
+    int in = 0;
+    for (int pass = 0; pass < passes; pass++)
+    {
+        int out = 3 - in;
+        AtrousPlanes src = {planes[in].data(), planes[in + 1].data(), planes[in + 2].data(), g.nx.data(),
+                            g.ny.data(), g.nz.data(), g.depth.data(), g.material.data(), w, hgt};
+        float colorScale = 1.0f / (sigma * sigma);
+        int step = 1 << pass;
+        parallelFor(hgt, threads, [&](int y)
+                    {
+                        thread_local vector<float> sum;
+                        sum.assign(4 * w, 0.0f);
+                        atrousRow(src, y, step, colorScale, sum.data());
+                        const float *sr = sum.data(), *sg = sr + w, *sb = sg + w, *sw = sb + w;
+                        // the center tap always has full weight, so sw > 0
+                        float *outR = &planes[out][y * w], *outG = &planes[out + 1][y * w], *outB = &planes[out + 2][y * w];
+                        for (int x = 0; x < w; x++)
+                        {
+                            outR[x] = sr[x] / sw[x];
+                            outG[x] = sg[x] / sw[x];
+                            outB[x] = sb[x] / sw[x];
+                        }
+                    });
+        in = out;
+        sigma *= 0.5f;
+    }
+
+    for (int y = 0; y < hgt; y++)
+        for (int x = 0; x < w; x++)
+        {
+            float *p = fb.pixel(window.x0 + x, window.y0 + y);
+            for (int c = 0; c < 3; c++)
+                p[c] = planes[in + c][y * w + x] / scale;
+        }
+}
@@ -0,0 +1,519 @@
+// Coordinator / worker tile rendering.
+//
+// The coordinator splits the image into tiles and hands them out one at a time
+// to worker processes. Local workers are forked after the scene is loaded and
+// talk over a Unix socketpair; remote workers run `--worker host:port`, load
+// their own description.txt and connect over TCP. A worker that dies (EOF or
+// error on its socket) has its in-flight tile put back on the queue, and so
+// does one that sends nothing for DIST_TILE_TIMEOUT seconds or answers
+// without holding a tile.
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#endif
+
+extern int pixel_size;
+extern int texture;
+extern bool rasterPrimary;
+extern Tile cropWindow;
+Tile frameWindow();
+
+const unsigned int DIST_MAGIC = 0x52543535; // "RT55"
+const int DIST_TILE_TIMEOUT = 120;          // seconds a worker may take for one tile
+
+struct DistHello
+{
+    unsigned int magic;
+    int pixel_size;
+    int recursion_level;
+    int object_count;
+    int texture;
+    int fast_math;
+    int roulette;
+    int raster;
+    int crop[4]; // x0, y0, x1, y1 of the crop window, all 0 for the whole frame
+    double min_weight;
+    double camera[12]; // pos, l, r, u
+};
+
+struct DistJob
+{
+    int id; // -1 asks the worker to exit
+    int x0, y0, x1, y1;
+};
+
+struct DistResult
+{
+    int id;
+    int bytes;
+};
+
+#ifndef _WIN32
+
+bool writeAll(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool readAll(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// everything a worker needs to trace the same frame as the coordinator,
+// seen from cam
+DistHello makeHello(const CameraPose &cam)
+{
+    DistHello h;
+    h.magic = DIST_MAGIC;
+    h.pixel_size = pixel_size;
+    h.recursion_level = recursion_level;
+    h.object_count = objects.size();
+    h.texture = texture;
+    h.fast_math = fastMath;
+    h.roulette = rouletteDepth;
+    h.raster = rasterPrimary;
+    h.crop[0] = cropWindow.x0, h.crop[1] = cropWindow.y0;
+    h.crop[2] = cropWindow.x1, h.crop[3] = cropWindow.y1;
+    h.min_weight = minPathWeight;
+    point axes[4] = {cam.pos, cam.l, cam.r, cam.u};
+    for (int i = 0; i < 4; i++)
+    {
+        h.camera[3 * i + 0] = axes[i].x;
+        h.camera[3 * i + 1] = axes[i].y;
+        h.camera[3 * i + 2] = axes[i].z;
+    }
+    return h;
+}
+
+// serve tile jobs on fd until told to stop or the coordinator goes away
+int runWorker(int fd)
+{
+    DistHello h;
+    if (!readAll(fd, &h, sizeof(h)) || h.magic != DIST_MAGIC)
+    {
+        cout << "Worker: bad handshake" << endl;
+        return 1;
+    }
+    if (h.pixel_size != pixel_size || h.recursion_level != recursion_level || h.object_count != (int)objects.size())
+    {
+        cout << "Worker: scene does not match the coordinator's" << endl;
+        return 1;
+    }
+    texture = h.texture;
+    rouletteDepth = h.roulette;
+    minPathWeight = h.min_weight;
+    if (h.fast_math != (int)fastMath)
+    {
+        fastMath = h.fast_math;
+        for (int i = 0; i < (int)objects.size(); i++)
+            objects[i]->bindKernel();
+    }
+    point axes[4];
+    for (int i = 0; i < 4; i++)
+        axes[i] = point(h.camera[3 * i + 0], h.camera[3 * i + 1], h.camera[3 * i + 2]);
+    CameraPose cam = {axes[0], axes[1], axes[2], axes[3]};
+    setupCamera(cam);
+    visibility.clear();
+    cropWindow = Tile(0, h.crop[0], h.crop[1], h.crop[2], h.crop[3]);
+    if (h.raster)
+        rasterizeVisibility(visibility, frameWindow());
+
+    vector<float> rgb;
+    DistJob job;
+    while (readAll(fd, &job, sizeof(job)) && job.id >= 0)
+    {
+        Tile tile(job.id, job.x0, job.y0, job.x1, job.y1);
+        rgb.assign(tile.pixelCount() * 3, 0.0f);
+        renderTile(tile, rgb.data());
+
+        DistResult res = {job.id, (int)(rgb.size() * sizeof(float))};
+        if (!writeAll(fd, &res, sizeof(res)) || !writeAll(fd, rgb.data(), res.bytes))
+            break;
+    }
+    close(fd);
+    return 0;
+}
+
+// --worker host:port
+int runRemoteWorker(const string &address)
+{
+    size_t colon = address.rfind(':');
+    if (colon == string::npos)
+    {
+        cout << "Worker: expected host:port, got " << address << endl;
+        return 1;
+    }
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    {
+        cout << "Worker: cannot resolve " << address << endl;
+        return 1;
+    }
+    int fd = -1;
+    for (addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+    {
+        cout << "Worker: cannot connect to " << address << endl;
+        return 1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    cout << "Worker: connected to " << address << endl;
+    return runWorker(fd);
+}
+
+int listenOn(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// reads on fd give up after DIST_TILE_TIMEOUT, so a peer that stops
+// mid-message cannot stall the coordinator
+void setReceiveTimeout(int fd)
+{
+    timeval tv = {DIST_TILE_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+struct WorkerSlot
+{
+    int fd;
+    pid_t pid; // 0 for remote workers
+    int tile;  // tile in flight, -1 when idle
+    long long sent; // trace timestamp of the current job
+};
+
+// each worker gets its own lane in the timeline
+int workerTraceId(int slot)
+{
+    return 1000 + slot;
+}
+
+// Render all tiles through workers and assemble them into fb.
+// Falls back to rendering in this process if every worker is gone and
+// nobody else can connect.
+void renderDistributed(const vector<Tile> &tiles, Framebuffer &fb, int localWorkers, int listenPort,
+                       const CameraPose &cam)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<WorkerSlot> workers;
+    DistHello hello = makeHello(cam);
+
+    cout.flush();
+    for (int i = 0; i < localWorkers; i++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            break;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(sv[0]);
+            for (int k = 0; k < (int)workers.size(); k++)
+                close(workers[k].fd);
+            _exit(runWorker(sv[1]));
+        }
+        close(sv[1]);
+        if (pid < 0)
+        {
+            close(sv[0]);
+            break;
+        }
+        WorkerSlot w = {sv[0], pid, -1, 0};
+        setReceiveTimeout(w.fd);
+        if (writeAll(w.fd, &hello, sizeof(hello)))
+        {
+            tracer.nameThread(workerTraceId(workers.size()), "local worker " + to_string(pid));
+            workers.push_back(w);
+        }
+        else
+            close(w.fd);
+    }
+
+    int listenFd = -1;
+    if (listenPort > 0)
+    {
+        listenFd = listenOn(listenPort);
+        if (listenFd < 0)
+            cout << "Coordinator: cannot listen on port " << listenPort << endl;
+        else
+            cout << "Coordinator: waiting for workers on port " << listenPort << endl;
+    }
+
+    deque<int> pending;
+    for (int i = 0; i < (int)tiles.size(); i++)
+        pending.push_back(i);
+    int remaining = tiles.size();
+    vector<float> rgb;
+
+    // close a worker that died, stalled or misbehaved and requeue its tile
+    auto dropWorker = [&](int i, const string &why)
+    {
+        WorkerSlot &w = workers[i];
+        cout << "Coordinator: " << why;
+        if (w.tile >= 0)
+        {
+            tracer.record("lost tile " + to_string(w.tile), "worker", w.sent, tracer.now(), workerTraceId(i));
+            cout << ", reassigning tile " << w.tile;
+            pending.push_front(w.tile);
+        }
+        cout << endl;
+        close(w.fd);
+        // a hung local worker would never be reaped otherwise
+        if (w.pid > 0)
+            kill(w.pid, SIGKILL);
+        w.fd = -1;
+        w.tile = -1;
+    };
+
+    while (remaining > 0)
+    {
+        // on cancel drop queued tiles and only wait for the ones in flight
+        if (renderProgress.cancel && !pending.empty())
+        {
+            remaining -= pending.size();
+            pending.clear();
+            if (remaining == 0)
+                break;
+        }
+
+        // hand out work to idle workers
+        for (int i = 0; i < (int)workers.size(); i++)
+        {
+            WorkerSlot &w = workers[i];
+            if (w.fd < 0 || w.tile >= 0 || pending.empty())
+                continue;
+            const Tile &t = tiles[pending.front()];
+            DistJob job = {t.id, t.x0, t.y0, t.x1, t.y1};
+            if (writeAll(w.fd, &job, sizeof(job)))
+            {
+                w.sent = tracer.now();
+                w.tile = pending.front();
+                pending.pop_front();
+            }
+            else
+            {
+                close(w.fd);
+                w.fd = -1;
+            }
+        }
+
+        vector<pollfd> fds;
+        vector<int> owner;
+        for (int i = 0; i < (int)workers.size(); i++)
+        {
+            if (workers[i].fd < 0)
+                continue;
+            pollfd p = {workers[i].fd, POLLIN, 0};
+            fds.push_back(p);
+            owner.push_back(i);
+        }
+        if (listenFd >= 0)
+        {
+            pollfd p = {listenFd, POLLIN, 0};
+            fds.push_back(p);
+            owner.push_back(-1);
+        }
+
+        if (fds.empty())
+        {
+            // nobody left to help: finish the job ourselves
+            cout << "Coordinator: no workers left, rendering " << remaining << " tiles locally" << endl;
+            while (!pending.empty() && !renderProgress.cancel)
+            {
+                const Tile &t = tiles[pending.front()];
+                pending.pop_front();
+                TraceScope scope("tile " + to_string(t.id), "tile");
+                rgb.assign(t.pixelCount() * 3, 0.0f);
+                renderTile(t, rgb.data());
+                storeTile(fb, t, rgb.data());
+                renderProgress.finish(t, rgb.data());
+                remaining--;
+            }
+            break;
+        }
+
+        // wake up in time for the first worker to run out of time
+        long long now = tracer.now(), deadline = -1;
+        for (int i = 0; i < (int)workers.size(); i++)
+            if (workers[i].fd >= 0 && workers[i].tile >= 0)
+            {
+                long long due = workers[i].sent + DIST_TILE_TIMEOUT * 1000000LL;
+                if (deadline < 0 || due < deadline)
+                    deadline = due;
+            }
+        int timeout = deadline < 0 ? -1 : (int)max(0LL, (deadline - now + 999) / 1000);
+        if (poll(fds.data(), fds.size(), timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int k = 0; k < (int)fds.size(); k++)
+        {
+            if (fds[k].revents == 0)
+                continue;
+            if (owner[k] < 0)
+            {
+                int fd = accept(listenFd, NULL, NULL);
+                if (fd < 0)
+                    continue;
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                setReceiveTimeout(fd);
+                WorkerSlot w = {fd, 0, -1, 0};
+                if (writeAll(fd, &hello, sizeof(hello)))
+                {
+                    tracer.nameThread(workerTraceId(workers.size()), "remote worker " + to_string(workers.size()));
+                    workers.push_back(w);
+                    cout << "Coordinator: remote worker joined" << endl;
+                }
+                else
+                    close(fd);
+                continue;
+            }
+
+            WorkerSlot &w = workers[owner[k]];
+            if (w.fd < 0)
+                continue;
+            if (w.tile < 0)
+            {
+                // nothing was asked of it: EOF, or a reply out of protocol
+                dropWorker(owner[k], "dropped an idle worker");
+                continue;
+            }
+            DistResult res;
+            bool ok = readAll(w.fd, &res, sizeof(res)) && res.id == tiles[w.tile].id &&
+                      res.bytes == tiles[w.tile].pixelCount() * 3 * (int)sizeof(float);
+            if (ok)
+            {
+                rgb.resize(tiles[w.tile].pixelCount() * 3);
+                ok = readAll(w.fd, rgb.data(), res.bytes);
+            }
+            if (!ok)
+            {
+                // worker died or misbehaved: requeue its tile
+                dropWorker(owner[k], "lost a worker");
+                continue;
+            }
+            storeTile(fb, tiles[w.tile], rgb.data());
+            renderProgress.finish(tiles[w.tile], rgb.data());
+            tracer.record("tile " + to_string(w.tile), "tile", w.sent, tracer.now(), workerTraceId(owner[k]));
+            w.tile = -1;
+            remaining--;
+        }
+
+        now = tracer.now();
+        for (int i = 0; i < (int)workers.size(); i++)
+            if (workers[i].fd >= 0 && workers[i].tile >= 0 &&
+                now - workers[i].sent >= DIST_TILE_TIMEOUT * 1000000LL)
+                dropWorker(i, "worker timed out");
+    }
+
+    DistJob stop = {-1, 0, 0, 0, 0};
+    for (int i = 0; i < (int)workers.size(); i++)
+    {
+        if (workers[i].fd >= 0)
+        {
+            writeAll(workers[i].fd, &stop, sizeof(stop));
+            close(workers[i].fd);
+        }
+        if (workers[i].pid > 0)
+            waitpid(workers[i].pid, NULL, 0);
+    }
+    if (listenFd >= 0)
+        close(listenFd);
+}
+
+#else
+
+int runRemoteWorker(const string &address)
+{
+    cout << "Distributed rendering is not supported on this platform" << endl;
+    return 1;
+}
+
+void renderDistributed(const vector<Tile> &tiles, Framebuffer &fb, int localWorkers, int listenPort,
+                       const CameraPose &cam)
+{
+    cout << "Distributed rendering is not supported on this platform, rendering locally" << endl;
+    vector<float> rgb;
+    for (int i = 0; i < (int)tiles.size() && !renderProgress.cancel; i++)
+    {
+        rgb.assign(tiles[i].pixelCount() * 3, 0.0f);
+        renderTile(tiles[i], rgb.data());
+        storeTile(fb, tiles[i], rgb.data());
+        renderProgress.finish(tiles[i], rgb.data());
+    }
+}
+
+#endif
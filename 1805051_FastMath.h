@@ -0,0 +1,87 @@
+// Approximations used by the --fast-math shading kernels. They avoid libm
+// calls, and the exp and reciprocal square root paths are also free of
+// data-dependent branches; powInt loops over the bits of the material's
+// shininess. All stay well below what 8-bit output can show. --bench-math
+// measures the actual error against the exact path.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+extern bool fastMath; // --fast-math
+
+// x^n for the integer shininess exponent, by repeated squaring; one pass
+// per bit of n, which is the same for every light of an object
+inline double powInt(double x, int n)
+{
+    double result = 1.0;
+    while (n > 0)
+    {
+        if (n & 1)
+            result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+// e^x from 2^k * e^f with |f| <= ln2/2; relative error below 2e-8
+inline double fastExp(double x)
+{
+    x = max(-700.0, min(700.0, x));
+    double k = floor(x * 1.4426950408889634 + 0.5);
+    double f = x - k * 0.6931471805599453;
+    double p = 1.0 + f * (1.0 + f * (1.0 / 2 + f * (1.0 / 6 + f * (1.0 / 24 + f * (1.0 / 120 + f * (1.0 / 720 + f * (1.0 / 5040)))))));
+    int64_t bits = (int64_t)(k + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// 1/sqrt(x) from the bit-level estimate refined by three Newton steps
+inline double fastInvSqrt(double x)
+{
+    int64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5fe6eb50c7b537a9LL - (bits >> 1);
+    double y;
+    memcpy(&y, &bits, sizeof(y));
+    double half = 0.5 * x;
+    y = y * (1.5 - half * y * y);
+    y = y * (1.5 - half * y * y);
+    y = y * (1.5 - half * y * y);
+    return y;
+}
+
+// float e^x for x <= 0 (denoiser edge-stopping weights); relative error
+// below 2e-7
+inline float fastExpNeg(float x)
+{
+    x = max(-87.0f, x);
+    int k = (int)(x * 1.44269504f - 0.5f);
+    float f = x - (float)k * 0.69314718f;
+    float p = 1.0f + f * (1.0f + f * (1.0f / 2 + f * (1.0f / 6 + f * (1.0f / 24 + f * (1.0f / 120 + f * (1.0f / 720))))));
+    int32_t bits = (k + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+#ifdef BITMAP_IMAGE_SSE2
+// fastExpNeg of four lanes
+inline __m128 fastExpNeg4(__m128 x)
+{
+    x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+    __m128i k = _mm_cvttps_epi32(_mm_sub_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f)));
+    __m128 f = _mm_sub_ps(x, _mm_mul_ps(_mm_cvtepi32_ps(k), _mm_set1_ps(0.69314718f)));
+    __m128 p = _mm_set1_ps(1.0f / 720);
+    const float c[6] = {1.0f / 120, 1.0f / 24, 1.0f / 6, 1.0f / 2, 1.0f, 1.0f};
+    for (int i = 0; i < 6; i++)
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[i]));
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(k, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+#endif
@@ -0,0 +1,198 @@
+// Golden-image equivalence check (--golden). Every scene of the corpus is
+// rendered once on the reference path (one thread, exact shading, full
+// recursion, scalar quantization) and once per optimized path; each result
+// is compared with bitmap_image::psnr and per-block psnr_region, and any
+// image that differs gets a hierarchical_psnr diff map in jet colors. The
+// process exits non-zero if a path falls below either threshold.
+
+extern string sceneFile, checkpointFile;
+extern bool rasterPrimary, compressedBVH;
+extern int localWorkers, renderThreads, rouletteDepth;
+extern bool pinThreads;
+extern RenderPool renderPool;
+void reloadScene();
+
+struct GoldenSettings
+{
+    bool fast, raster;
+    double minWeight;
+    int threads, workers; // threads 0 = one per core (at least two)
+    bool simdQuantize;
+    bool compressed; // packed BVH nodes, rebuilt when this changes
+};
+
+struct GoldenVariant
+{
+    const char *name;
+    GoldenSettings settings;
+};
+
+// reference first; every other entry changes one thing
+const GoldenVariant goldenVariants[] = {
+    {"reference", {false, false, 0.0, 1, 0, false, false}},
+    {"simd-quantize", {false, false, 0.0, 1, 0, true, false}},
+    {"threads", {false, false, 0.0, 0, 0, true, false}},
+#ifndef _WIN32
+    {"workers", {false, false, 0.0, 1, 2, true, false}},
+#endif
+    {"raster", {false, true, 0.0, 1, 0, true, false}},
+    {"adaptive", {false, false, 1.0 / 512, 1, 0, true, false}},
+    {"fast-math", {true, false, 0.0, 1, 0, true, false}},
+    {"compressed-bvh", {false, false, 0.0, 1, 0, true, true}},
+};
+
+// per-pixel lrint of the clamped, scaled radiance; what the SIMD path must match
+void quantizeScalar(Framebuffer &fb, bitmap_image &img, double exposure)
+{
+    img.setwidth_height(fb.width, fb.height);
+    float k = 255.0f * (float)exposure;
+    for (int y = 0; y < fb.height; y++)
+        for (int x = 0; x < fb.width; x++)
+        {
+            float *p = fb.pixel(x, y);
+            img.set_pixel(x, y, (unsigned char)lrint(min(255.0f, max(0.0f, k * p[0]))),
+                          (unsigned char)lrint(min(255.0f, max(0.0f, k * p[1]))),
+                          (unsigned char)lrint(min(255.0f, max(0.0f, k * p[2]))));
+        }
+}
+
+// render the loaded scene with the given settings; seconds taken
+double goldenRender(const GoldenSettings &g, bitmap_image &img)
+{
+    if (g.compressed != compressedBVH)
+    {
+        compressedBVH = g.compressed;
+        reloadScene();
+    }
+    fastMath = g.fast;
+    bindShadingKernels();
+    rasterPrimary = g.raster;
+    minPathWeight = g.minWeight;
+    localWorkers = g.workers;
+    int threads = g.threads > 0 ? g.threads : max(2, (int)thread::hardware_concurrency());
+    if (threads > 1)
+        renderPool.start(threads, pinThreads);
+
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    renderFrame();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    renderPool.stop();
+
+    img = bitmap_image(framebuffer.width, framebuffer.height);
+    if (g.simdQuantize)
+        quantize(framebuffer, img, exposure);
+    else
+        quantizeScalar(framebuffer, img, exposure);
+    return seconds;
+}
+
+// lowest PSNR of any block x block region; partial blocks at the edges count
+double worstBlockPsnr(bitmap_image &a, bitmap_image &b, int block)
+{
+    double worst = 1000000.0;
+    for (unsigned int y = 0; y < a.height(); y += block)
+        for (unsigned int x = 0; x < a.width(); x += block)
+            worst = min(worst, psnr_region(x, y, min((unsigned int)block, a.width() - x),
+                                           min((unsigned int)block, a.height() - y), a, b));
+    return worst;
+}
+
+string psnrText(double psnr)
+{
+    if (psnr >= 1000000.0)
+        return "inf";
+    stringstream ss;
+    ss << fixed << setprecision(2) << psnr;
+    return ss.str();
+}
+
+// file name without directory and extension, for the diff images
+string sceneStem(const string &path)
+{
+    size_t slash = path.find_last_of("/\\");
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == string::npos ? name : name.substr(0, dot);
+}
+
+bool runGolden(const vector<string> &scenes, double minPsnr, double minBlockPsnr)
+{
+    string savedScene = sceneFile;
+    bool savedFast = fastMath, savedRaster = rasterPrimary, savedCompressed = compressedBVH;
+    double savedWeight = minPathWeight;
+    int savedWorkers = localWorkers, savedRoulette = rouletteDepth;
+    Tile savedCrop = cropWindow;
+    string savedCheckpoint = checkpointFile;
+    rouletteDepth = 0;
+    compressedBVH = false;
+    cropWindow = Tile();
+    checkpointFile = "";
+    bool pooled = renderPool.size() > 0;
+    renderPool.stop();
+
+    bool pass = true;
+    cout << left << setw(24) << "scene" << setw(15) << "path" << setw(10) << "seconds" << setw(10) << "PSNR"
+         << setw(12) << "worst 16px" << setw(10) << "pixels" << "result" << endl;
+    for (int s = 0; s < (int)scenes.size(); s++)
+    {
+        sceneFile = scenes[s];
+        if (!ifstream(sceneFile.c_str()))
+        {
+            cout << left << setw(24) << sceneFile << "missing" << endl;
+            pass = false;
+            continue;
+        }
+        reloadScene();
+
+        bitmap_image reference;
+        double referenceSeconds = 0;
+        for (int v = 0; v < (int)(sizeof(goldenVariants) / sizeof(goldenVariants[0])); v++)
+        {
+            const GoldenVariant &variant = goldenVariants[v];
+            bitmap_image img;
+            double seconds = goldenRender(variant.settings, img);
+            cout << left << setw(24) << sceneFile << setw(15) << variant.name << setw(10) << fixed << setprecision(3)
+                 << seconds;
+            if (v == 0)
+            {
+                reference = img;
+                referenceSeconds = seconds;
+                cout << endl;
+                continue;
+            }
+
+            double psnr = reference.psnr(img);
+            double worst = worstBlockPsnr(reference, img, 16);
+            const unsigned char *a = reference.data(), *b = img.data();
+            long long differing = 0;
+            for (unsigned int i = 0; i < img.pixel_count(); i++)
+                differing += a[3 * i] != b[3 * i] || a[3 * i + 1] != b[3 * i + 1] || a[3 * i + 2] != b[3 * i + 2];
+            bool ok = psnr >= minPsnr && worst >= minBlockPsnr;
+            pass = pass && ok;
+            cout << setw(10) << psnrText(psnr) << setw(12) << psnrText(worst) << setw(10) << differing
+                 << (ok ? "ok" : "FAIL") << " (" << setprecision(2) << referenceSeconds / max(1e-9, seconds) << "x)"
+                 << endl;
+
+            if (differing > 0)
+            {
+                bitmap_image diff = img;
+                hierarchical_psnr(reference, diff, minBlockPsnr, jet_colormap);
+                diff.save_image("golden_" + sceneStem(sceneFile) + "_" + variant.name + ".bmp");
+            }
+        }
+    }
+
+    sceneFile = savedScene;
+    fastMath = savedFast, rasterPrimary = savedRaster, compressedBVH = savedCompressed;
+    minPathWeight = savedWeight;
+    localWorkers = savedWorkers, rouletteDepth = savedRoulette;
+    cropWindow = savedCrop;
+    checkpointFile = savedCheckpoint;
+    bindShadingKernels();
+    reloadScene();
+    if (pooled)
+        renderPool.start(renderThreads, pinThreads);
+    cout << (pass ? "golden: all paths within " : "golden: FAILED, thresholds ") << psnrText(minPsnr) << " dB overall, "
+         << psnrText(minBlockPsnr) << " dB per 16x16 block" << endl;
+    return pass;
+}
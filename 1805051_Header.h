@@ -40,6 +40,15 @@ struct point
         z /= len;
     }
 
+    // normalize() through the approximate reciprocal square root (--fast-math)
+    void normalizeFast()
+    {
+        double inv = fastInvSqrt(x * x + y * y + z * z);
+        x *= inv;
+        y *= inv;
+        z *= inv;
+    }
+
     /** streams  **/
 
     friend ostream &operator<<(ostream &out, point p)
@@ -61,17 +70,27 @@ struct point
     }
 };
 
+// upper end of an unbounded ray interval
+const double RAY_FAR = 1e300;
+
 struct Ray
 {
     point origin, dir;
+    // only hits with tmin < t <= tmax count; nearest-hit queries pull tmax in
+    // to the closest hit so far, so farther primitives are rejected early
+    double tmin, tmax;
 
-    Ray(point origin, point dir)
+    Ray(point origin, point dir, double tmin = 0, double tmax = RAY_FAR)
     {
         this->origin = origin;
         dir.normalize();
         this->dir = dir;
+        this->tmin = tmin;
+        this->tmax = tmax;
     }
 
+    bool accepts(double t) const { return t > tmin && t <= tmax; }
+
     // stream
     friend ostream &operator<<(ostream &out, Ray r)
     {
@@ -112,8 +131,15 @@ struct SpotLight
     Light pointLight;
     point dir;
     double cutoffAngle; // this is different from the spotlight
+    point unitDir;      // dir normalized, for the cosine cone test
+    double cosCutoff;
 
-    SpotLight(Light pointLight, point dir, double cutoffAngle) : pointLight(pointLight), dir(dir), cutoffAngle(cutoffAngle) {}
+    SpotLight(Light pointLight, point dir, double cutoffAngle) : pointLight(pointLight), dir(dir), cutoffAngle(cutoffAngle)
+    {
+        unitDir = dir;
+        unitDir.normalize();
+        cosCutoff = cos(cutoffAngle * M_PI / 180.0);
+    }
 
     void draw()
     {
@@ -155,9 +181,58 @@ extern int texture;
 extern bitmap_image texture_b;
 extern bitmap_image texture_w;
 
+// scene queries backed by the acceleration structure (1805051_BVH.h)
+int nearestObject(Ray ray, double &tHit);
+bool isOccluded(Ray ray, double dist, point target, int spot = -1);
+Object *sceneObject(int index);
+
+// What a ray can still contribute to its pixel. Reflection stops once the
+// weight drops under minPathWeight or the radiance already settled by earlier
+// rays saturates the pixel, so recursion_level is only an upper bound. The
+// saturation test is off when the float radiance is saved (--hdr) or the
+// weight test is (--min-weight 0), since either needs values above white.
+struct PathWeight
+{
+    double throughput; // product of kr along the path, roulette included
+    point settled;     // pixel radiance fixed by the rays before this one
+
+    PathWeight() : throughput(1.0) {}
+    PathWeight(double throughput, point settled) : throughput(throughput), settled(settled) {}
+};
+
+extern double minPathWeight; // --min-weight W
+extern int rouletteDepth;    // --roulette LEVEL, 0 = off
+extern double exposure;
+extern string hdrFile;
+
+// per-pixel random stream for Russian roulette, seeded from the pixel so the
+// image does not depend on tile order, threads or workers
+thread_local unsigned int rouletteState = 1;
+
+void seedRoulette(int i, int j)
+{
+    rouletteState = ((unsigned int)i * 73856093u) ^ ((unsigned int)j * 19349663u) ^ 0x9e3779b9u;
+    if (rouletteState == 0)
+        rouletteState = 1;
+}
+
+// uniform in [0, 1)
+double rouletteSample()
+{
+    rouletteState ^= rouletteState << 13;
+    rouletteState ^= rouletteState >> 17;
+    rouletteState ^= rouletteState << 5;
+    return rouletteState / 4294967296.0;
+}
+
+// shading routine of one material feature set, see shadeKernel below
+typedef double (*ShadeKernel)(Object *obj, Ray ray, point &col, int level, PathWeight path);
+double missingKernel(Object *obj, Ray ray, point &col, int level, PathWeight path);
+
 class Object
 {
 public:
+    ShadeKernel kernel;
     point reference_point;
     double height, width, length;
     point color;
@@ -169,180 +244,59 @@ public:
         height = width = length = 0;
         color = point(0, 0, 0);
         shine = kd = ks = ka = kr = 0;
+        kernel = missingKernel;
     }
+    virtual ~Object() {}
     virtual void draw() = 0;
+    virtual Object *clone(SceneArena &arena) = 0;
     virtual double intersect_shapes(Ray ray, point &col) = 0;
+    // axis aligned bounds; false for unbounded primitives kept out of the BVH
+    virtual bool getBounds(point &lo, point &hi)
+    {
+        return false;
+    }
+    // finite bounds for visibility culling, also for primitives kept out of
+    // the BVH; false if the object is truly unbounded
+    virtual bool getExtent(point &lo, point &hi)
+    {
+        return getBounds(lo, hi);
+    }
+    // corners of a planar convex outline for the rasterizer, 0 if not a polygon
+    virtual int getPolygon(point *verts)
+    {
+        return 0;
+    }
+    // center and radius for objects the preview draws as shared spheres
+    virtual bool getSphere(point &center, double &radius)
+    {
+        return false;
+    }
+    // false when this object can never block the segment between a and b
+    virtual bool canOcclude(point a, point b)
+    {
+        return true;
+    }
     virtual point getColorAt(point pt)
     {
         return color;
     }
     virtual Ray getNormal(point pt, Ray incidentRay) = 0;
-    virtual double intersect(Ray ray, point &col, int level)
+    // shading entry point; the kernel is specialized for this material
+    virtual double intersect(Ray ray, point &col, int level, PathWeight path = PathWeight())
     {
-        double t = intersect_shapes(ray, col);
-        if (t < 0)
-            return -1;
-
-        point intersection_point = ray.origin + ray.dir * t;
-
         if (level == 0)
         {
-            // col = getColorAt(intersection_point);
-            return t;
-        }
-
-        point color_intersection = getColorAt(intersection_point);
-
-        // cout << "color_intersection: " << color_intersection << endl;
-        // Update color with ambience
-        col.x = color_intersection.x * ka;
-        col.y = color_intersection.y * ka;
-        col.z = color_intersection.z * ka;
-
-        double lambert = 0.0, phong = 0.0;
-        for (int i = 0; i < normal_lights.size(); i++)
-        {
-            point position = normal_lights[i].pos;
-            point direction = intersection_point - position;
-            direction.normalize();
-
-            Ray normal_lightray(position, direction);
-            Ray normal = getNormal(intersection_point, normal_lightray);
-
-            bool isShadow = false;
-            double dist = (position - intersection_point).length();
-            if (dist < 1e-5)
-                continue;
-            for (int j = 0; j < objects.size(); j++)
-            {
-                double t2 = objects[j]->intersect_shapes(normal_lightray, col);
-                if (t2 > 0 && t2 + 1e-5 < dist)
-                {
-                    isShadow = true;
-                    break;
-                }
-            }
-
-            if (isShadow)
-                continue;
-            point toSource = normal_lightray.origin - intersection_point;
-            toSource.normalize();
-            double scaling_factor = exp(-dist * dist * normal_lights[i].falloff);
-            lambert += (max(0.0, toSource * normal.dir)) * scaling_factor;
-
-            double dotProduct = max(0.0, ray.dir * normal.dir);
-            point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
-            reflection_dir.normalize();
-            Ray reflected_ray(intersection_point, reflection_dir);
-            phong += pow(max(0.0, reflection_dir * toSource), shine) * scaling_factor;
-            // cout << "lambert: " << lambert << endl;
-
-            col.x += kd * lambert * color_intersection.x;
-            col.y += kd * lambert * color_intersection.y;
-            col.z += kd * lambert * color_intersection.z;
-            if (ks > 0)
-            {
-                col.x += ks * phong * normal_lights[i].color.x;
-                col.y += ks * phong * normal_lights[i].color.y;
-                col.z += ks * phong * normal_lights[i].color.z;
-            }
-        }
-
-        // Problem in this section of code. Need to fix it
-        for (int i = 0; i < spot_lights.size(); i++)
-        {
-            point position = spot_lights[i].pointLight.pos;
-            point direction = intersection_point - position;
-            direction.normalize();
-
-            double dot = direction * spot_lights[i].dir;
-            double angle = acos(dot / (direction.length() * spot_lights[i].dir.length())) * (180.0 / M_PI);
-            // cout << "angle: " << angle << endl;
-
-            if (fabs(angle) < spot_lights[i].cutoffAngle)
-            {
-                Ray spot_lightray(position, direction);
-                Ray normal = getNormal(intersection_point, spot_lightray);
-
-                bool isShadow = false;
-                double dist = (intersection_point - position).length();
-                if (dist < 1e-5)
-                {
-                    // cout << " l: " << lambert << " p: " << phong << endl;
-                    continue;
-                }
-                for (int j = 0; j < objects.size(); j++)
-                {
-                    double t2 = objects[j]->intersect_shapes(spot_lightray, col);
-                    // cout << " l: " << lambert << " p: " << phong << endl;
-                    if (t2 > 0 && t2 + 1e-5 < dist)
-                    {
-                        isShadow = true;
-                        break;
-                    }
-                }
-
-                if (isShadow)
-                    continue;
-                point toSource = -spot_lightray.dir;
-                double scaling_factor = exp(-dist * dist * spot_lights[i].pointLight.falloff);
-                lambert += (max(0.0, toSource * normal.dir)) * scaling_factor;
-
-                double dotProduct = max(0.0, ray.dir * normal.dir);
-                point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
-                reflection_dir.normalize();
-                Ray reflected_ray(intersection_point, reflection_dir);
-                phong += pow(max(0.0, reflection_dir * toSource), shine) * scaling_factor;
-                // cout << " l: " << lambert << " p: " << phong << endl;
-
-                col.x += kd * lambert * color_intersection.x;
-                col.y += kd * lambert * color_intersection.y;
-                col.z += kd * lambert * color_intersection.z;
-                if (ks > 0)
-                {
-                    col.x += ks * phong * spot_lights[i].pointLight.color.x;
-                    col.y += ks * phong * spot_lights[i].pointLight.color.y;
-                    col.z += ks * phong * spot_lights[i].pointLight.color.z;
-                }
-            }
-        }
-
-        // I think this part is ok
-        if (level <= recursion_level)
-        {
-            // cout << "level: " << level << endl;
-            Ray normal = getNormal(intersection_point, ray);
-            double dotProduct = ray.dir * normal.dir;
-            point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
-            reflection_dir.normalize();
-
-            Ray reflected_ray(intersection_point, reflection_dir);
-            reflected_ray.origin = reflected_ray.origin + reflected_ray.dir * 1e-5;
-
-            double t = -1;
-            int nearest = -1;
-
-            for (int i = 0; i < objects.size(); i++)
-            {
-                double t2 = objects[i]->intersect(reflected_ray, col, 0);
-                if (t2 > 0 && (t == -1 || t2 < t))
-                {
-                    t = t2;
-                    nearest = i;
-                }
-            }
-
-            if (nearest != -1)
-            {
-                point reflected_color;
-                double t = objects[nearest]->intersect(reflected_ray, reflected_color, level + 1);
-                col.x += kr * reflected_color.x;
-                col.y += kr * reflected_color.y;
-                col.z += kr * reflected_color.z;
-            }
+            double t = intersect_shapes(ray, col);
+            return t < 0 ? -1 : t;
         }
-        return t;
+        return kernel(this, ray, col, level, path);
+    }
+    // true when getColorAt varies over the surface
+    virtual bool hasTexture()
+    {
+        return false;
     }
+    void bindKernel();
     virtual void print()
     {
         cout << "Reference Point: " << reference_point << endl;
@@ -378,6 +332,219 @@ public:
     }
 };
 
+// Phong shading with shadows and mirror reflection. The material features are
+// template flags so every combination gets its own kernel with the unused
+// branches compiled out; Object::bindKernel picks one per object after loading.
+// Fast swaps exp, pow, acos and sqrt for the approximations in 1805051_FastMath.h.
+template <bool Specular, bool Reflective, bool Textured, bool SpotLit, bool Fast>
+double shadeKernel(Object *obj, Ray ray, point &col, int level, PathWeight path)
+{
+    double t = obj->intersect_shapes(ray, col);
+    if (t < 0)
+        return -1;
+
+    point intersection_point = ray.origin + ray.dir * t;
+
+    point color_intersection = Textured ? obj->getColorAt(intersection_point) : obj->color;
+    const double ka = obj->ka, kd = obj->kd, ks = obj->ks, kr = obj->kr;
+    const int shine = obj->shine;
+
+    // Update color with ambience
+    col.x = color_intersection.x * ka;
+    col.y = color_intersection.y * ka;
+    col.z = color_intersection.z * ka;
+
+    double lambert = 0.0, phong = 0.0;
+    for (int i = 0; i < normal_lights.size(); i++)
+    {
+        point position = normal_lights[i].pos;
+        point direction = intersection_point - position;
+        if (Fast)
+            direction.normalizeFast();
+        else
+            direction.normalize();
+
+        Ray normal_lightray(position, direction);
+        Ray normal = obj->getNormal(intersection_point, normal_lightray);
+
+        double dist = (position - intersection_point).length();
+        if (dist < 1e-5)
+            continue;
+        if (isOccluded(normal_lightray, dist, intersection_point))
+            continue;
+        point toSource = normal_lightray.origin - intersection_point;
+        if (Fast)
+            toSource.normalizeFast();
+        else
+            toSource.normalize();
+        double scaling_factor = Fast ? fastExp(-dist * dist * normal_lights[i].falloff) : exp(-dist * dist * normal_lights[i].falloff);
+        lambert += (max(0.0, toSource * normal.dir)) * scaling_factor;
+
+        if (Specular)
+        {
+            double dotProduct = max(0.0, ray.dir * normal.dir);
+            point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
+            if (Fast)
+                reflection_dir.normalizeFast();
+            else
+                reflection_dir.normalize();
+            phong += (Fast ? powInt(max(0.0, reflection_dir * toSource), shine) : pow(max(0.0, reflection_dir * toSource), shine)) * scaling_factor;
+        }
+
+        col.x += kd * lambert * color_intersection.x;
+        col.y += kd * lambert * color_intersection.y;
+        col.z += kd * lambert * color_intersection.z;
+        if (Specular)
+        {
+            col.x += ks * phong * normal_lights[i].color.x;
+            col.y += ks * phong * normal_lights[i].color.y;
+            col.z += ks * phong * normal_lights[i].color.z;
+        }
+    }
+
+    for (int i = 0; SpotLit && i < spot_lights.size(); i++)
+    {
+        point position = spot_lights[i].pointLight.pos;
+        point direction = intersection_point - position;
+        if (Fast)
+            direction.normalizeFast();
+        else
+            direction.normalize();
+
+        bool inCone;
+        if (Fast)
+            inCone = direction * spot_lights[i].unitDir > spot_lights[i].cosCutoff;
+        else
+        {
+            double dot = direction * spot_lights[i].dir;
+            double angle = acos(dot / (direction.length() * spot_lights[i].dir.length())) * (180.0 / M_PI);
+            inCone = fabs(angle) < spot_lights[i].cutoffAngle;
+        }
+
+        if (inCone)
+        {
+            Ray spot_lightray(position, direction);
+            Ray normal = obj->getNormal(intersection_point, spot_lightray);
+
+            double dist = (intersection_point - position).length();
+            if (dist < 1e-5)
+                continue;
+            if (isOccluded(spot_lightray, dist, intersection_point, i))
+                continue;
+            point toSource = -spot_lightray.dir;
+            double scaling_factor = Fast ? fastExp(-dist * dist * spot_lights[i].pointLight.falloff) : exp(-dist * dist * spot_lights[i].pointLight.falloff);
+            lambert += (max(0.0, toSource * normal.dir)) * scaling_factor;
+
+            if (Specular)
+            {
+                double dotProduct = max(0.0, ray.dir * normal.dir);
+                point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
+                if (Fast)
+                    reflection_dir.normalizeFast();
+                else
+                    reflection_dir.normalize();
+                phong += (Fast ? powInt(max(0.0, reflection_dir * toSource), shine) : pow(max(0.0, reflection_dir * toSource), shine)) * scaling_factor;
+            }
+
+            col.x += kd * lambert * color_intersection.x;
+            col.y += kd * lambert * color_intersection.y;
+            col.z += kd * lambert * color_intersection.z;
+            if (Specular)
+            {
+                col.x += ks * phong * spot_lights[i].pointLight.color.x;
+                col.y += ks * phong * spot_lights[i].pointLight.color.y;
+                col.z += ks * phong * spot_lights[i].pointLight.color.z;
+            }
+        }
+    }
+
+    if (Reflective && level <= recursion_level)
+    {
+        // skip bounces that cannot visibly change the pixel
+        double weight = path.throughput * kr;
+        point settled = path.settled + col * path.throughput;
+        double limit = 1.0 / exposure;
+        bool headroom = minPathWeight > 0 && hdrFile.empty();
+        if (weight < minPathWeight ||
+            (headroom && settled.x >= limit && settled.y >= limit && settled.z >= limit))
+            return t;
+        // deep bounces survive with probability weight and are scaled up to stay unbiased
+        double scale = kr;
+        if (rouletteDepth > 0 && level >= rouletteDepth && weight < 1.0)
+        {
+            if (rouletteSample() >= weight)
+                return t;
+            scale = kr / weight;
+        }
+
+        Ray normal = obj->getNormal(intersection_point, ray);
+        double dotProduct = ray.dir * normal.dir;
+        point reflection_dir = ray.dir - normal.dir * (2.0 * dotProduct);
+        if (Fast)
+            reflection_dir.normalizeFast();
+        else
+            reflection_dir.normalize();
+
+        Ray reflected_ray(intersection_point, reflection_dir);
+        reflected_ray.origin = reflected_ray.origin + reflected_ray.dir * 1e-5;
+
+        double t2;
+        int nearest = nearestObject(reflected_ray, t2);
+
+        if (nearest != -1)
+        {
+            point reflected_color;
+            sceneObject(nearest)->intersect(reflected_ray, reflected_color, level + 1,
+                                            PathWeight(path.throughput * scale, settled));
+            col.x += scale * reflected_color.x;
+            col.y += scale * reflected_color.y;
+            col.z += scale * reflected_color.z;
+        }
+    }
+    return t;
+}
+
+template <bool Specular, bool Reflective, bool Textured, bool SpotLit>
+ShadeKernel pickKernel()
+{
+    return fastMath ? shadeKernel<Specular, Reflective, Textured, SpotLit, true> : shadeKernel<Specular, Reflective, Textured, SpotLit, false>;
+}
+
+template <bool Specular, bool Reflective, bool Textured>
+ShadeKernel pickKernel(bool spotLit)
+{
+    return spotLit ? pickKernel<Specular, Reflective, Textured, true>() : pickKernel<Specular, Reflective, Textured, false>();
+}
+
+template <bool Specular, bool Reflective>
+ShadeKernel pickKernel(bool textured, bool spotLit)
+{
+    return textured ? pickKernel<Specular, Reflective, true>(spotLit) : pickKernel<Specular, Reflective, false>(spotLit);
+}
+
+template <bool Specular>
+ShadeKernel pickKernel(bool reflective, bool textured, bool spotLit)
+{
+    return reflective ? pickKernel<Specular, true>(textured, spotLit) : pickKernel<Specular, false>(textured, spotLit);
+}
+
+// material and scene flags are fixed once the scene is loaded; call again
+// after toggling fastMath
+void Object::bindKernel()
+{
+    bool specular = ks > 0;
+    bool reflective = kr > 0 && recursion_level >= 1;
+    bool spotLit = !spot_lights.empty();
+    kernel = specular ? pickKernel<true>(reflective, hasTexture(), spotLit)
+                      : pickKernel<false>(reflective, hasTexture(), spotLit);
+}
+
+double missingKernel(Object *obj, Ray ray, point &col, int level, PathWeight path)
+{
+    obj->bindKernel();
+    return obj->kernel(obj, ray, col, level, path);
+}
+
 struct Floor : public Object
 {
     int tiles;
@@ -394,6 +561,16 @@ struct Floor : public Object
         shine = 30;
     }
 
+    virtual Object *clone(SceneArena &arena)
+    {
+        return arena.make<Floor>(*this);
+    }
+
+    virtual bool hasTexture()
+    {
+        return true;
+    }
+
     virtual point getColorAt(point pt)
     {
 
@@ -474,26 +651,48 @@ struct Floor : public Object
         glEnd();
     }
 
+    // the floor is the plane z = 0 clipped to tiles x tiles squares
     virtual double intersect_shapes(Ray ray, point &col)
     {
-        point normal = point(0, 0, 1);
-        double dotP = normal * ray.dir;
-
-        if (round(dotP * 100) == 0)
+        if (fabs(ray.dir.z) < 1e-9)
             return -1;
 
-        double t = -(normal * ray.origin) / dotP;
-
-        point p = ray.origin + ray.dir * t;
+        double t = -ray.origin.z / ray.dir.z;
+        if (!ray.accepts(t))
+            return -1;
 
-        if (p.x <= reference_point.x || p.x >= abs(reference_point.x) && p.y <= reference_point.y && p.y >= abs(reference_point.y))
-        {
+        double x = ray.origin.x + ray.dir.x * t - reference_point.x;
+        double y = ray.origin.y + ray.dir.y * t - reference_point.y;
+        double size = tiles * length;
+        if (x < 0 || x > size || y < 0 || y > size)
             return -1;
-        }
-        // col = getColorAt(p);
 
         return t;
     }
+
+    virtual int getPolygon(point *verts)
+    {
+        double size = tiles * length;
+        verts[0] = point(reference_point.x, reference_point.y, 0);
+        verts[1] = point(reference_point.x + size, reference_point.y, 0);
+        verts[2] = point(reference_point.x + size, reference_point.y + size, 0);
+        verts[3] = point(reference_point.x, reference_point.y + size, 0);
+        return 4;
+    }
+
+    virtual bool getExtent(point &lo, point &hi)
+    {
+        double size = tiles * length;
+        lo = point(reference_point.x, reference_point.y, -1e-5);
+        hi = point(reference_point.x + size, reference_point.y + size, 1e-5);
+        return true;
+    }
+
+    // a segment can only cross z = 0 if its ends are on opposite sides
+    virtual bool canOcclude(point a, point b)
+    {
+        return (a.z > 0 && b.z < 0) || (a.z < 0 && b.z > 0);
+    }
 };
 
 struct triangle : public Object
@@ -511,6 +710,11 @@ struct triangle : public Object
         this->c = c;
     }
 
+    virtual Object *clone(SceneArena &arena)
+    {
+        return arena.make<triangle>(*this);
+    }
+
     virtual Ray getNormal(point pt, Ray incidentRay)
     {
         point normal = (b - a) ^ (c - a);
@@ -538,8 +742,38 @@ struct triangle : public Object
         glEnd();
     }
 
+    virtual int getPolygon(point *verts)
+    {
+        verts[0] = a;
+        verts[1] = b;
+        verts[2] = c;
+        return 3;
+    }
+
+    virtual bool getBounds(point &lo, point &hi)
+    {
+        lo = point(min(a.x, min(b.x, c.x)), min(a.y, min(b.y, c.y)), min(a.z, min(b.z, c.z)));
+        hi = point(max(a.x, max(b.x, c.x)), max(a.y, max(b.y, c.y)), max(a.z, max(b.z, c.z)));
+        return true;
+    }
+
     virtual double intersect_shapes(Ray ray, point &col)
     {
+        double AMat[3][3]{
+            {a.x - b.x, a.x - c.x, ray.dir.x},
+            {a.y - b.y, a.y - c.y, ray.dir.y},
+            {a.z - b.z, a.z - c.z, ray.dir.z}};
+        double tMat[3][3] = {
+            {a.x - b.x, a.x - c.x, a.x - ray.origin.x},
+            {a.y - b.y, a.y - c.y, a.y - ray.origin.y},
+            {a.z - b.z, a.z - c.z, a.z - ray.origin.z}};
+
+        // distance first, the barycentric tests only for hits in range
+        double Adet = determinant(AMat);
+        double t = determinant(tMat) / Adet;
+        if (!ray.accepts(t))
+            return -1;
+
         double betaMat[3][3] = {
             {a.x - ray.origin.x, a.x - c.x, ray.dir.x},
             {a.y - ray.origin.y, a.y - c.y, ray.dir.y},
@@ -548,21 +782,10 @@ struct triangle : public Object
             {a.x - b.x, a.x - ray.origin.x, ray.dir.x},
             {a.y - b.y, a.y - ray.origin.y, ray.dir.y},
             {a.z - b.z, a.z - ray.origin.z, ray.dir.z}};
-        double tMat[3][3] = {
-            {a.x - b.x, a.x - c.x, a.x - ray.origin.x},
-            {a.y - b.y, a.y - c.y, a.y - ray.origin.y},
-            {a.z - b.z, a.z - c.z, a.z - ray.origin.z}};
-        double AMat[3][3]{
-            {a.x - b.x, a.x - c.x, ray.dir.x},
-            {a.y - b.y, a.y - c.y, ray.dir.y},
-            {a.z - b.z, a.z - c.z, ray.dir.z}};
-
-        double Adet = determinant(AMat);
         double beta = determinant(betaMat) / Adet;
         double gamma = determinant(gammaMat) / Adet;
-        double t = determinant(tMat) / Adet;
 
-        if (beta + gamma < 1 && beta > 0 && gamma > 0 && t > 0)
+        if (beta + gamma < 1 && beta > 0 && gamma > 0)
         {
             // col = color;
             return t;
@@ -602,6 +825,11 @@ struct square : public Object
         this->d = d;
     }
 
+    virtual Object *clone(SceneArena &arena)
+    {
+        return arena.make<square>(*this);
+    }
+
     virtual void draw()
     {
         glColor3f(color.x, color.y, color.z);
@@ -626,6 +854,25 @@ struct square : public Object
         return {pt, normal};
     }
 
+    virtual int getPolygon(point *verts)
+    {
+        verts[0] = a;
+        verts[1] = b;
+        verts[2] = c;
+        verts[3] = d;
+        return 4;
+    }
+
+    // isPointInsideSquare accepts hits up to 1e-5 outside the corners
+    virtual bool getBounds(point &lo, point &hi)
+    {
+        lo = point(min(min(a.x, b.x), min(c.x, d.x)), min(min(a.y, b.y), min(c.y, d.y)), min(min(a.z, b.z), min(c.z, d.z)));
+        hi = point(max(max(a.x, b.x), max(c.x, d.x)), max(max(a.y, b.y), max(c.y, d.y)), max(max(a.z, b.z), max(c.z, d.z)));
+        lo = lo - point(1e-5, 1e-5, 1e-5);
+        hi = hi + point(1e-5, 1e-5, 1e-5);
+        return true;
+    }
+
     virtual double intersect_shapes(Ray ray, point &col)
     {
         // Find the normal of the square plane
@@ -640,6 +887,8 @@ struct square : public Object
         {
             // Calculate the distance from the ray's origin to the plane
             double t = normal * (a - ray.origin) / denom;
+            if (!ray.accepts(t))
+                return -1.0;
 
             // Check if the intersection point is within the bounds of the square
             point intersectionPoint = ray.origin + ray.dir * t;
@@ -667,6 +916,11 @@ struct sphere : public Object
         length = width = height = radius;
     }
 
+    virtual Object *clone(SceneArena &arena)
+    {
+        return arena.make<sphere>(*this);
+    }
+
     virtual void draw()
     {
         glPushMatrix();
@@ -683,6 +937,20 @@ struct sphere : public Object
         return Ray(pt, dir);
     }
 
+    virtual bool getSphere(point &center, double &radius)
+    {
+        center = reference_point;
+        radius = length;
+        return true;
+    }
+
+    virtual bool getBounds(point &lo, point &hi)
+    {
+        lo = reference_point - point(length, length, length);
+        hi = reference_point + point(length, length, length);
+        return true;
+    }
+
     virtual double intersect_shapes(Ray ray, point &col)
     {
         point oc = ray.origin - reference_point;
@@ -697,14 +965,12 @@ struct sphere : public Object
             double t1 = (-b + sqrt(d)) / (2 * a);
             double t2 = (-b - sqrt(d)) / (2 * a);
             // col = color;
-            if (t1 < 0 && t2 < 0)
-                return -1;
-            else if (t1 < 0)
+            // t2 <= t1: the entry point if it is in range, else the exit point
+            if (ray.accepts(t2))
                 return t2;
-            else if (t2 < 0)
+            if (ray.accepts(t1))
                 return t1;
-            else
-                return min(t1, t2);
+            return -1;
         }
     }
 };
@@ -0,0 +1,263 @@
+// Two-level scene: shapes repeated across the scene (cubes, pyramids) are
+// built once as object-space prototypes with their own BVH, and every copy
+// is an Instance holding only a transform and its material. Rays are moved
+// into object space without renormalizing the direction, so hit distances
+// and the ray interval mean the same thing on both levels.
+
+// affine map p -> (row[0] * p, row[1] * p, row[2] * p) + offset
+struct Transform
+{
+    point row[3];
+    point offset;
+
+    Transform()
+    {
+        row[0] = point(1, 0, 0);
+        row[1] = point(0, 1, 0);
+        row[2] = point(0, 0, 1);
+    }
+
+    static Transform scaleTranslate(point scale, point offset)
+    {
+        Transform m;
+        m.row[0] = point(scale.x, 0, 0);
+        m.row[1] = point(0, scale.y, 0);
+        m.row[2] = point(0, 0, scale.z);
+        m.offset = offset;
+        return m;
+    }
+
+    point linear(point v) { return point(row[0] * v, row[1] * v, row[2] * v); }
+
+    point apply(point p) { return linear(p) + offset; }
+
+    double det() { return row[0] * (row[1] ^ row[2]); }
+
+    // columns of the inverse are the cross products of the rows over det
+    Transform inverse()
+    {
+        double d = det();
+        point c[3] = {(row[1] ^ row[2]) / d, (row[2] ^ row[0]) / d, (row[0] ^ row[1]) / d};
+        Transform inv;
+        inv.row[0] = point(c[0].x, c[1].x, c[2].x);
+        inv.row[1] = point(c[0].y, c[1].y, c[2].y);
+        inv.row[2] = point(c[0].z, c[1].z, c[2].z);
+        inv.offset = -inv.linear(offset);
+        return inv;
+    }
+};
+
+// object-space faces shared by all instances of one shape
+struct Prototype
+{
+    string name;
+    vector<Object *> faces; // owned by the scene arena
+    SceneAccel accel;
+    AABB bounds;
+
+    // call once every face is added
+    void finish()
+    {
+        accel.build(faces);
+        bounds = AABB();
+        for (int i = 0; i < (int)faces.size(); i++)
+        {
+            AABB box;
+            if (faces[i]->getBounds(box.lo, box.hi))
+                bounds.expand(box);
+        }
+    }
+
+    virtual ~Prototype() {}
+
+    // copy with its own faces and hierarchy in arena, for a node-local
+    // scene replica
+    virtual Prototype *clone(SceneArena &arena)
+    {
+        Prototype *p = arena.make<Prototype>(*this);
+        for (int i = 0; i < (int)faces.size(); i++)
+            p->faces[i] = faces[i]->clone(arena);
+        return p;
+    }
+
+    // nearest face hit in the ray's interval, -1 if none
+    virtual int nearest(Ray &ray, double &tHit)
+    {
+        int best = -1;
+        tHit = -1;
+        accel.bvh.nearest(faces, ray, tHit, best);
+        return best;
+    }
+
+    // object-space normal of face at p, facing against ray
+    virtual point faceNormal(int face, point p, Ray ray)
+    {
+        return faces[face]->getNormal(p, ray).dir;
+    }
+
+    // distance from p to the plane of face
+    virtual double faceDistance(int face, point p)
+    {
+        point verts[8];
+        if (faces[face]->getPolygon(verts) < 3)
+            return 1e300;
+        point n = (verts[1] - verts[0]) ^ (verts[2] - verts[0]);
+        n.normalize();
+        return fabs((p - verts[0]) * n);
+    }
+
+    // face whose plane passes closest to p among those whose boxes lie on a
+    // short probe through it, widened until one is found; for points no ray
+    // lookup resolves, such as a light ray grazing the face. -1 without faces
+    int closestFace(point p)
+    {
+        int best = -1;
+        double bestDistance = 1e300;
+        double diagonal = (bounds.hi - bounds.lo).length() + 1;
+        for (double reach = 1e-6 * diagonal; best < 0; reach *= 1000)
+        {
+            Ray probe(p, point(1, 1, 1), -reach, reach);
+            accel.bvh.traverse(probe, [&](int k)
+                               {
+                                   double d = faceDistance(k, p);
+                                   if (d < bestDistance)
+                                   {
+                                       bestDistance = d;
+                                       best = k;
+                                   }
+                                   return false;
+                               });
+            if (reach > diagonal)
+                break;
+        }
+        return best;
+    }
+
+    // object-space outline for the preview
+    virtual void drawFaces()
+    {
+        point verts[8];
+        for (int i = 0; i < (int)faces.size(); i++)
+        {
+            int n = faces[i]->getPolygon(verts);
+            glBegin(GL_POLYGON);
+            for (int k = 0; k < n; k++)
+                glVertex3d(verts[k].x, verts[k].y, verts[k].z);
+            glEnd();
+        }
+    }
+};
+
+struct Instance : public Object
+{
+    Prototype *proto;
+    Transform toWorld, toObject;
+    point normalRows[3]; // inverse transpose of the linear part, for normals
+
+    Instance(Prototype *proto, Transform toWorld) : proto(proto), toWorld(toWorld)
+    {
+        toObject = toWorld.inverse();
+        normalRows[0] = point(toObject.row[0].x, toObject.row[1].x, toObject.row[2].x);
+        normalRows[1] = point(toObject.row[0].y, toObject.row[1].y, toObject.row[2].y);
+        normalRows[2] = point(toObject.row[0].z, toObject.row[1].z, toObject.row[2].z);
+    }
+
+    virtual Object *clone(SceneArena &arena)
+    {
+        return arena.make<Instance>(*this);
+    }
+
+    // same ray in object space; t and [tmin, tmax] carry over unchanged
+    Ray objectRay(Ray ray)
+    {
+        Ray local = ray;
+        local.origin = toObject.apply(ray.origin);
+        local.dir = toObject.linear(ray.dir);
+        return local;
+    }
+
+    virtual double intersect_shapes(Ray ray, point &col)
+    {
+        Ray local = objectRay(ray);
+        double t;
+        return proto->nearest(local, t) < 0 ? -1 : t;
+    }
+
+    // the face through pt is the one incidentRay hits right there; a ray
+    // that grazes it or slips past an edge falls back to the nearest face
+    virtual Ray getNormal(point pt, Ray incidentRay)
+    {
+        double along = (pt - incidentRay.origin) * incidentRay.dir;
+        double slack = 1e-7 * (1.0 + fabs(along));
+        Ray local = objectRay(incidentRay);
+        local.tmin = along - slack;
+        local.tmax = along + slack;
+        double t;
+        point p = toObject.apply(pt);
+        int face = proto->nearest(local, t);
+        if (face < 0)
+            face = proto->closestFace(p);
+        if (face < 0)
+            return Ray(pt, -incidentRay.dir);
+        point n = proto->faceNormal(face, p, local);
+        return Ray(pt, point(normalRows[0] * n, normalRows[1] * n, normalRows[2] * n));
+    }
+
+    virtual bool getBounds(point &lo, point &hi)
+    {
+        AABB box;
+        for (int k = 0; k < 8; k++)
+            box.expand(toWorld.apply(point((k & 1) ? proto->bounds.hi.x : proto->bounds.lo.x,
+                                           (k & 2) ? proto->bounds.hi.y : proto->bounds.lo.y,
+                                           (k & 4) ? proto->bounds.hi.z : proto->bounds.lo.z)));
+        lo = box.lo;
+        hi = box.hi;
+        return true;
+    }
+
+    virtual void draw()
+    {
+        GLdouble m[16] = {toWorld.row[0].x, toWorld.row[1].x, toWorld.row[2].x, 0,
+                          toWorld.row[0].y, toWorld.row[1].y, toWorld.row[2].y, 0,
+                          toWorld.row[0].z, toWorld.row[1].z, toWorld.row[2].z, 0,
+                          toWorld.offset.x, toWorld.offset.y, toWorld.offset.z, 1};
+        glPushMatrix();
+        glMultMatrixd(m);
+        glColor3f(color.x, color.y, color.z);
+        proto->drawFaces();
+        glPopMatrix();
+    }
+};
+
+// unit cube [0, 1]^3, faces in the order readFile always emitted them
+Prototype *makeBoxPrototype(SceneArena &arena)
+{
+    Prototype *p = arena.make<Prototype>();
+    p->name = "box";
+    point A(0, 1, 0), B(0, 1, 1), C(1, 1, 1), D(1, 1, 0);
+    point E(0, 0, 0), F(0, 0, 1), G(1, 0, 1), H(1, 0, 0);
+    p->faces.push_back(arena.make<square>(A, B, C, D));
+    p->faces.push_back(arena.make<square>(E, F, G, H));
+    p->faces.push_back(arena.make<square>(E, A, B, F));
+    p->faces.push_back(arena.make<square>(F, B, C, G));
+    p->faces.push_back(arena.make<square>(G, C, D, H));
+    p->faces.push_back(arena.make<square>(H, D, A, E));
+    p->finish();
+    return p;
+}
+
+// unit pyramid over [0, 1]^2 with its apex at height 1, faces as readFile
+// always emitted them
+Prototype *makePyramidPrototype(SceneArena &arena)
+{
+    Prototype *p = arena.make<Prototype>();
+    p->name = "pyramid";
+    point A(0, 0, 0), B(1, 0, 0), C(1, 1, 0), D(0, 1, 0), E(0.5, 0.5, 1);
+    p->faces.push_back(arena.make<triangle>(A, B, E));
+    p->faces.push_back(arena.make<triangle>(B, C, E));
+    p->faces.push_back(arena.make<triangle>(C, D, E));
+    p->faces.push_back(arena.make<triangle>(D, A, E));
+    p->faces.push_back(arena.make<square>(B, C, D, E));
+    p->finish();
+    return p;
+}
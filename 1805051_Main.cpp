@@ -2,7 +2,9 @@
 
 #include <iostream>
 #include <stdio.h>
+#ifdef _WIN32
 #include <windows.h> // for MS Windows
+#endif
 #include <GL/glut.h> // GLUT, include glu.h and gl.h
 #include <cmath>
 #include <vector>
@@ -10,8 +12,24 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <csignal>
 #include "bitmap_image.hpp"
+#include "1805051_Arena.h"
+#include "1805051_FastMath.h"
 #include "1805051_Header.h"
+#include "1805051_BVH.h"
+#include "1805051_Instance.h"
+#include "1805051_Mesh.h"
+#include "1805051_Render.h"
+#include "1805051_Checkpoint.h"
+#include "1805051_Raster.h"
+#include "1805051_Preview.h"
+#include "1805051_Denoise.h"
+#include "1805051_Trace.h"
+#include "1805051_Distributed.h"
+#include "1805051_Pool.h"
+#include "1805051_Bench.h"
+#include "1805051_Golden.h"
 
 using namespace std;
 
@@ -19,6 +37,7 @@ bitmap_image image;
 vector<Light> normal_lights;
 vector<SpotLight> spot_lights;
 vector<Object *> objects;
+SceneArena sceneArena; // owns everything in objects
 
 struct point pos(0, -200, 35); // position of the eye
 struct point l;                // look/forward direction
@@ -36,11 +55,73 @@ float windowHeight = 4;
 int imageCount = 1;
 int recursion_level;
 
+// tiled / distributed rendering
+int tileSize = 32;
+TileOrder renderOrder = ORDER_HILBERT; // --order scanline|morton|hilbert
+bool benchOrder = false;              // --bench-order: time every ordering and exit
+int benchLoads = 0;                   // --bench-load N: reload the scene N times and exit
+bool benchMathMode = false;           // --bench-math: compare exact and fast shading and exit
+bool fastMath = false;                // --fast-math: approximate exp/pow/acos/sqrt while shading
+double minPathWeight = 1.0 / 512;     // --min-weight W: drop reflections weighing less than W
+int rouletteDepth = 0;                // --roulette LEVEL: Russian roulette from this depth on, 0 = off
+bool rasterPrimary = false;           // --raster: primary hits from a rasterized visibility buffer
+bool compressedBVH = false;           // --bvh full|compressed: node layout of every hierarchy
+BVHBuilder bvhBuilder = BUILD_SAH;    // --bvh-build median|sah|lbvh: how hierarchies are split
+bool benchBvhMode = false;            // --bench-bvh: compare BVH builders and layouts and exit
+Tile cropWindow;                      // --crop X Y W H: trace only this rectangle, empty = whole frame
+string compositeFile = "";            // --composite FILE: paste the crop into this earlier full render
+string checkpointFile = "";           // --checkpoint FILE: journal finished tiles and resume from it
+string sceneFile = "description.txt"; // --scene FILE
+int denoisePasses = 0;                // --denoise N: a-trous passes over the captured frame, 0 = off
+double denoiseSigma = 0.8;            // --denoise-sigma S: color difference still smoothed over
+vector<string> goldenScenes;          // --golden [FILE...]: compare every render path against the reference and exit
+bool goldenMode = false;
+double goldenPsnr = 40.0;             // --golden-psnr DB: minimum PSNR of a whole image
+double goldenBlockPsnr = 30.0;        // --golden-block DB: minimum PSNR of any 16x16 block
+int renderThreads = 0;                // --threads N, 0 = one per core
+bool pinThreads = true;               // --no-pin leaves placement to the OS
+RenderPool renderPool;
+int localWorkers = 0;      // --workers N
+int listenPort = 0;        // --listen PORT
+bool headless = false;     // --headless: render once and exit without opening a window
+string workerAddress = ""; // --worker HOST:PORT
+
+// linear radiance of the last capture; quantized to 8-bit only when saved
+Framebuffer framebuffer;
+double exposure = 1.0; // --exposure SCALE, applied at quantization
+string hdrFile = "";   // --hdr FILE.pfm
+string fromHdr = "";   // --from-hdr FILE.pfm: re-expose a saved render instead of tracing
+
+// image plane, filled in by setupCamera(); the eye and axes are copied so
+// the camera can keep moving while a capture runs in the background
+point topLeft;
+double du, dv;
+point camEye, camRight, camUp, camForward;
+
+CameraPose currentCamera()
+{
+	CameraPose cam = {pos, l, r, u};
+	return cam;
+}
+
+// background capture started with '0'
+thread captureThread;
+atomic<bool> capturing(false);
+
 float gridCenterX = 0.0f;
 float gridCenterY = 0.0f;
 
-bitmap_image texture_w("texture_w.bmp");
-bitmap_image texture_b("texture_b.bmp");
+bitmap_image texture_w;
+bitmap_image texture_b;
+
+string traceFile = ""; // --trace FILE.json: Chrome trace of the render phases
+
+void loadTextures()
+{
+    TraceScope scope("loadTextures", "load");
+    texture_w = bitmap_image("texture_w.bmp");
+    texture_b = bitmap_image("texture_b.bmp");
+}
 
 /* Initialize OpenGL Graphics */
 void initGL()
@@ -78,6 +159,47 @@ void drawAxes()
     glEnd();
 }
 
+// overlay the tiles finished so far on top of the OpenGL preview
+void drawCaptureProgress()
+{
+	if(!capturing)
+		return;
+	lock_guard<mutex> guard(renderProgress.lock);
+	if(renderProgress.finished.empty())
+		return;
+
+	int w = glutGet(GLUT_WINDOW_WIDTH), h = glutGet(GLUT_WINDOW_HEIGHT);
+	double scale = min(w, h) / (double)renderProgress.width;
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluOrtho2D(0, w, 0, h);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	glDisable(GL_DEPTH_TEST);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, renderProgress.width);
+	glPixelZoom(scale, -scale);
+	for(int k=0;k<(int)renderProgress.finished.size();k++)
+	{
+		Tile &t = renderProgress.finished[k];
+		glRasterPos2d(t.x0 * scale, h - t.y0 * scale);
+		glDrawPixels(t.width(), t.height(), GL_RGB, GL_UNSIGNED_BYTE,
+			&renderProgress.preview[((size_t)t.y0 * renderProgress.width + t.x0) * 3]);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelZoom(1, 1);
+
+	glEnable(GL_DEPTH_TEST);
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+
 void display()
 {
     // glClear(GL_COLOR_BUFFER_BIT);            // Clear the color buffer (background)
@@ -98,10 +220,8 @@ void display()
     gridCenterX = -pos.x; // Inverse translation for grid center
     gridCenterY = -pos.y;
 
-    for (int i = 0; i < objects.size(); i++)
-    {
-        objects[i]->draw();
-    }
+    // the objects are drawn rotated by angle, so undo it for the eye
+    drawPreview(rotateY(pos, -angle), rotateY(l, -angle));
 
     for (int i = 0; i < normal_lights.size(); i++)
     {
@@ -115,86 +235,376 @@ void display()
 
     // drawAxes();
 
+    drawCaptureProgress();
+
     glutSwapBuffers(); // Render now
 }
 
-void capture()
+void setupCamera(CameraPose cam)
 {
-    cout<<"Capturing Image"<<endl;
-
-    image = bitmap_image(pixel_size, pixel_size);
-
-	// initialize bitmap image and set background color to black
-	for(int i=0;i<pixel_size;i++)
-		for(int j=0;j<pixel_size;j++)
-			image.set_pixel(i, j, 0, 0, 0);
-	
-	// image.save_image("black.bmp");
-
 	windowHeight  = 2*(near_plane * tan((M_PI * fov/2) / 360.0));
     windowWidth = windowHeight * aspect_ratio;
 
-	point topLeft = pos + (l * near_plane) + (u * (windowHeight / 2.0)) - (r * (windowWidth / 2.0));
+	topLeft = cam.pos + (cam.l * near_plane) + (cam.u * (windowHeight / 2.0)) - (cam.r * (windowWidth / 2.0));
 
-	double du = windowWidth / (pixel_size*1.0);
-	double dv = windowHeight / (pixel_size*1.0);
+	du = windowWidth / (pixel_size*1.0);
+	dv = windowHeight / (pixel_size*1.0);
 
 	// Choose middle of the grid cell
-	topLeft = topLeft + (r * du / 2.0) - (u * dv / 2.0);
+	topLeft = topLeft + (cam.r * du / 2.0) - (cam.u * dv / 2.0);
+
+	camEye = cam.pos;
+	camRight = cam.r;
+	camUp = cam.u;
+	camForward = cam.l;
+}
+
+void setupCamera()
+{
+	setupCamera(currentCamera());
+}
+
+// Objects the primary rays of a tile can hit: bounds overlapping the frustum
+// from the eye through the tile's pixels, between the near and far planes.
+// False when the tile sees too many for a list to beat the BVH.
+bool tileCandidates(const Tile &tile, vector<int> &ids)
+{
+	// half a pixel of slack around the outermost pixel centers
+	double x[2] = {tile.x0 - 0.5, tile.x1 - 0.5};
+	double y[2] = {tile.y0 - 0.5, tile.y1 - 0.5};
+	point corner[4];
+	for(int k=0;k<4;k++)
+	{
+		int a = (k == 1 || k == 2), b = (k >= 2);
+		corner[k] = topLeft + (camRight * du * x[a]) - (camUp * dv * y[b]) - camEye;
+	}
+	point center = (corner[0] + corner[2]) * 0.5;
+
+	Frustum frustum;
+	for(int k=0;k<4;k++)
+	{
+		point n = corner[k] ^ corner[(k + 1) % 4];
+		if(n * center < 0)
+			n = -n;
+		frustum.add(n, camEye);
+	}
+	frustum.add(camForward, camEye + camForward * near_plane);
+	frustum.add(-camForward, camEye + camForward * far_plane);
+	return visibleObjects(frustum, ids, 32);
+}
+
+// trace the primary ray through pixel (i, j) and return its linear color;
+// candidates, if given, are the only objects the ray can hit
+point tracePixel(int i, int j, const vector<int> *candidates = NULL)
+{
+	// calculate current pixel
+	point pixel = topLeft + (camRight * du * i) - (camUp * dv * j);
+
+	// cast ray from EYE to (curPixel-eye) direction ; eye is the position of the camera
+	Ray ray = primaryRay(pixel-camEye);
+	point color;
+
+	seedRoulette(i, j);
+
+	// find nearest object
+	double tMin;
+	int nearestObjectIndex;
+	if(visibility.ready())
+		nearestObjectIndex = visibility.id[j * visibility.width + i];
+	else
+		nearestObjectIndex = candidates ? nearestAmong(*candidates, ray, tMin) : nearestObject(ray, tMin);
+
+	// if nearest object is found, then shade the pixel
+	color = point(0,0,0);
+	if(nearestObjectIndex != -1 && sceneObject(nearestObjectIndex)->intersect(ray,color, 1) < 0)
+	{
+		// the rasterizer widened a silhouette the ray misses; ask the BVH
+		nearestObjectIndex = nearestObject(ray, tMin);
+		color = point(0,0,0);
+		if(nearestObjectIndex != -1)
+			sceneObject(nearestObjectIndex)->intersect(ray,color, 1);
+	}
+	return color;
+}
+
+// render one tile into row-major linear RGB, visiting pixels in renderOrder
+void renderTile(const Tile &tile, float *rgb)
+{
+	// most tiles share a size, so keep the last ordering around
+	thread_local vector<int> order;
+	thread_local int orderW = -1, orderH = -1, orderKind = -1;
+	if(tile.width() != orderW || tile.height() != orderH || renderOrder != orderKind)
+	{
+		curveOffsets(tile.width(), tile.height(), renderOrder, order);
+		orderW = tile.width(), orderH = tile.height(), orderKind = renderOrder;
+	}
 
-	int nearestObjectIndex = -1;
-	double t,tMin;
+	// primary rays test only what the tile can see; nothing means sky
+	thread_local vector<int> candidates;
+	bool culled = !visibility.ready() && tileCandidates(tile, candidates);
+	if(culled && candidates.empty())
+		return;
 
-	for(int i=0;i<pixel_size;i++)
+	for(int k=0;k<(int)order.size();k++)
 	{
-		for(int j=0;j<pixel_size;j++)
+		int i = tile.x0 + order[k] % tile.width();
+		int j = tile.y0 + order[k] / tile.width();
+		point color = tracePixel(i, j, culled ? &candidates : NULL);
+		float *p = rgb + 3 * order[k];
+		p[0] = color.x;
+		p[1] = color.y;
+		p[2] = color.z;
+	}
+}
+
+// --crop: reduce framebuffer to the window, or paste the window into the full
+// render named by --composite (.pfm composites in linear radiance)
+void cropOutput(bitmap_image &base)
+{
+	Framebuffer region;
+	cropFramebuffer(framebuffer, cropWindow, region);
+	if(compositeFile == "")
+	{
+		swap(framebuffer, region);
+		return;
+	}
+	if(compositeFile.size() > 4 && compositeFile.substr(compositeFile.size() - 4) == ".pfm")
+	{
+		Framebuffer full;
+		if(loadPFM(full, compositeFile) && full.width == pixel_size && full.height == pixel_size)
 		{
-			// calculate current pixel
-			point pixel = topLeft + (r * du * i) - (u * dv * j);
-
-			// cast ray from EYE to (curPixel-eye) direction ; eye is the position of the camera
-			Ray ray(pos,pixel-pos);
-			point color;
-
-			// cout<<"Ray direction "<<ray.dir<<endl;
-
-			// find nearest object
-			tMin = -1;
-			nearestObjectIndex = -1;
-			for(int k=0;k<(int)objects.size();k++)
-			{
-				t = objects[k]->intersect(ray,color, 0);
-				if(t>0 && (nearestObjectIndex == -1 || t<tMin) )
-					tMin = t , nearestObjectIndex = k;
-			}
-
-			// if nearest object is found, then shade the pixel
-			if(nearestObjectIndex != -1)
-			{
-				// cout<<"Object "<<nearestObjectIndex<<" intersected"<<endl;
-				// color = objects[nearestObjectIndex]->color;
-				color = point(0,0,0);
-				// cout<<"Before Color "<<color.x<<" "<<color.y<<" "<<color.z<<endl;
-				double t = objects[nearestObjectIndex]->intersect(ray,color, 1);
-
-				if(color.x > 1) color.x = 1;
-				if(color.y > 1) color.y = 1;
-				if(color.z > 1) color.z = 1;
-
-				if(color.x < 0) color.x = 0;
-				if(color.y < 0) color.y = 0;
-				if(color.z < 0) color.z = 0;
-				
-				// cout<<"After Color "<<color.x<<" "<<color.y<<" "<<color.z<<endl;
-				image.set_pixel(i, j, 255*color.x, 255*color.y, 255*color.z);
-			}
+			storeTile(full, cropWindow, region.rgb.data());
+			swap(framebuffer, full);
+			return;
 		}
 	}
+	else
+	{
+		base = bitmap_image(compositeFile);
+		if((int)base.width() == pixel_size && (int)base.height() == pixel_size)
+		{
+			swap(framebuffer, region);
+			return;
+		}
+		base.clear();
+	}
+	cout << "Cannot composite into " << compositeFile << ", writing the crop alone" << endl;
+	swap(framebuffer, region);
+}
+
+// quantize the framebuffer to 8-bit and write Output.bmp (plus the HDR file if asked)
+void saveFramebuffer()
+{
+	bitmap_image base;
+	if(cropWindow.pixelCount() > 0 && framebuffer.width == pixel_size && framebuffer.height == pixel_size)
+		cropOutput(base);
+	image = bitmap_image(framebuffer.width, framebuffer.height);
+	{
+		TraceScope scope("quantize", "output");
+		quantize(framebuffer, image, exposure);
+	}
+	if(base.width() > 0)
+	{
+		base.copy_from(image, cropWindow.x0, cropWindow.y0);
+		image = base;
+	}
+	{
+		TraceScope scope("save_image", "output");
+		image.save_image("Output.bmp");
+		if(hdrFile != "")
+			savePFM(framebuffer, hdrFile);
+	}
+	image.clear();
+}
+
+// the pixels a capture traces
+Tile frameWindow()
+{
+	if(cropWindow.pixelCount() > 0)
+		return cropWindow;
+	return Tile(0, 0, 0, pixel_size, pixel_size);
+}
+
+// everything that decides the traced pixels; a checkpoint only resumes
+// a render with the same hash
+unsigned long long renderHash()
+{
+	ifstream in(sceneFile.c_str(), ios::binary);
+	string scene((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	unsigned long long h = hashBytes(scene.data(), scene.size());
+	// meshes are named by the scene, so a changed model file changes its size or time
+	for(map<string, MeshPrototype *>::iterator m = loadedMeshes.begin(); m != loadedMeshes.end(); ++m)
+	{
+		error_code ec;
+		long long stamp[] = {(long long)filesystem::file_size(m->first, ec),
+							 (long long)filesystem::last_write_time(m->first, ec).time_since_epoch().count()};
+		h = hashBytes(stamp, sizeof(stamp), h);
+	}
+	int ints[] = {pixel_size, recursion_level, texture, fastMath, rouletteDepth, tileSize,
+				  cropWindow.x0, cropWindow.y0, cropWindow.x1, cropWindow.y1, hdrFile != ""};
+	h = hashBytes(ints, sizeof(ints), h);
+	point cam[] = {camEye, camRight, camUp, camForward, topLeft};
+	for(int k=0;k<5;k++)
+	{
+		double v[] = {cam[k].x, cam[k].y, cam[k].z};
+		h = hashBytes(v, sizeof(v), h);
+	}
+	double values[] = {du, dv, minPathWeight, exposure};
+	return hashBytes(values, sizeof(values), h);
+}
+
+// trace every tile as seen from cam into framebuffer; false if cancelled
+bool renderFrame(const CameraPose &cam)
+{
+	// background stays black where nothing is hit
+	framebuffer.resize(pixel_size, pixel_size);
+
+	setupCamera(cam);
+	visibility.clear();
+	if(rasterPrimary)
+	{
+		TraceScope scope("rasterize", "render");
+		rasterizeVisibility(visibility, frameWindow());
+	}
 
-	image.save_image("Output.bmp");
+	vector<Tile> tiles = makeTiles(pixel_size, tileSize);
+	if(cropWindow.pixelCount() > 0)
+		cropTiles(tiles, cropWindow);
+	orderTiles(tiles, renderOrder, tileSize);
+
+	// skip what an interrupted run of the same render already finished
+	bool resumed = false;
+	if(checkpointFile != "")
+	{
+		vector<int> done;
+		if(journal.open(checkpointFile, renderHash(), pixel_size, pixel_size, done) && !done.empty())
+		{
+			sort(done.begin(), done.end());
+			vector<Tile> left;
+			for(int k=0;k<(int)tiles.size();k++)
+				if(!binary_search(done.begin(), done.end(), tiles[k].id))
+					left.push_back(tiles[k]);
+			cout<<"Resuming "<<checkpointFile<<": "<<tiles.size() - left.size()<<" of "<<tiles.size()<<" tiles already done"<<endl;
+			tiles.swap(left);
+			resumed = true;
+		}
+	}
+
+	renderProgress.begin(tiles.size(), pixel_size);
+	if(localWorkers > 0 || listenPort > 0)
+	{
+		renderDistributed(tiles, framebuffer, localWorkers, listenPort, cam);
+	}
+	else if(renderPool.size() > 1)
+	{
+		renderPool.render(tiles, framebuffer, tileSize);
+	}
+	else
+	{
+		vector<float> rgb;
+		for(int k=0;k<(int)tiles.size() && !renderProgress.cancel;k++)
+		{
+			TraceScope scope("tile " + to_string(tiles[k].id), "tile");
+			rgb.assign(tiles[k].pixelCount() * 3, 0.0f);
+			renderTile(tiles[k], rgb.data());
+			storeTile(framebuffer, tiles[k], rgb.data());
+			renderProgress.finish(tiles[k], rgb.data());
+		}
+	}
+	if(checkpointFile != "")
+	{
+		journal.close();
+		if(resumed && !renderProgress.cancel)
+			journal.restore(framebuffer);
+	}
+	return !renderProgress.cancel;
+}
+
+bool renderFrame()
+{
+	return renderFrame(currentCamera());
+}
+
+// --denoise: filter the traced window of framebuffer before it is saved
+void denoiseFrame()
+{
+	TraceScope scope("denoise", "output");
+	Tile window = frameWindow();
+	GuideBuffer guides;
+	buildGuides(guides, window, renderThreads);
+	denoise(framebuffer, guides, window, denoisePasses, denoiseSigma, exposure, renderThreads);
+}
+
+void capture(const CameraPose &cam)
+{
+    cout<<"Capturing Image"<<endl;
+	long long captureStart = tracer.now();
+
+	if(!renderFrame(cam))
+	{
+		cout<<"Capture cancelled after "<<renderProgress.describe()<<endl;
+		return;
+	}
+
+	if(denoisePasses > 0)
+		denoiseFrame();
+	saveFramebuffer();
 	imageCount++;
 	cout<<"Saving Image"<<endl;
-    image.clear();
+	if(checkpointFile != "")
+		journal.discard();
+
+	tracer.record("capture", "render", captureStart, tracer.now(), tracer.threadId());
+	if(traceFile != "")
+		writeTrace(traceFile);
+}
+
+void startCapture()
+{
+	if(capturing)
+	{
+		cout<<"A capture is already running ("<<renderProgress.describe()<<")"<<endl;
+		return;
+	}
+	if(captureThread.joinable())
+		captureThread.join();
+	capturing = true;
+	CameraPose cam = currentCamera();
+	captureThread = thread([cam]
+	{
+		capture(cam);
+		capturing = false;
+	});
+}
+
+void cancelCapture()
+{
+	if(capturing)
+		renderProgress.cancel = true;
+	if(captureThread.joinable())
+		captureThread.join();
+}
+
+// polls the background capture: progress line, preview refresh, cleanup
+void captureTimer(int value)
+{
+	static int lastDone = -1;
+	if(captureThread.joinable())
+	{
+		if(renderProgress.done != lastDone)
+		{
+			lastDone = renderProgress.done;
+			cout<<"Capturing: "<<renderProgress.describe()<<endl;
+			glutPostRedisplay();
+		}
+		if(!capturing)
+		{
+			captureThread.join();
+			lastDone = -1;
+			glutPostRedisplay();
+		}
+	}
+	glutTimerFunc(500, captureTimer, 0);
 }
 
 /* Handler for window re-size event. Called back when the window first appears and
@@ -303,7 +713,14 @@ void keyboardListener(unsigned char key, int x, int y)
         drawgrid = 1 - drawgrid;
         break;
     case '0':
-        capture();
+        startCapture();
+        break;
+    case 'x':
+        // abort the running capture
+        cancelCapture();
+        break;
+    case 'r':
+        reloadScene();
         break;
     case 32:
         texture = 1 - texture;
@@ -311,6 +728,7 @@ void keyboardListener(unsigned char key, int x, int y)
 
     // Control exit
     case 27:     // ESC key
+        cancelCapture();
         exit(0); // Exit window
         break;
     }
@@ -360,13 +778,36 @@ void specialKeyListener(int key, int x, int y)
     glutPostRedisplay(); // Post a paint request to activate display()
 }
 
+// drop the loaded scene; every primitive goes with the arena in one go
+void clearScene()
+{
+    objects.clear();
+    normal_lights.clear();
+    spot_lights.clear();
+    loadedMeshes.clear();
+    sceneArena.reset();
+}
+
+// choose each object's shading kernel now that materials and lights are known
+void bindShadingKernels()
+{
+    for (int i = 0; i < (int)objects.size(); i++)
+        objects[i]->bindKernel();
+    for (int n = 0; n < (int)renderPool.replicas.size(); n++)
+        if (renderPool.replicas[n] != NULL)
+            for (int i = 0; i < (int)renderPool.replicas[n]->objects.size(); i++)
+                renderPool.replicas[n]->objects[i]->bindKernel();
+}
+
 void readFile()
 {
+    TraceScope scope("readFile", "load");
+    clearScene();
     ifstream file;
-    file.open("description.txt");
+    file.open(sceneFile.c_str());
     if (!file)
     {
-        cout << "Unable to open file";
+        cout << "Unable to open " << sceneFile << endl;
         exit(1); // terminate with error
     }
     string line;
@@ -414,7 +855,7 @@ void readFile()
     kr = coord[2];
     cout << ka << " " << kd << " " << kr << endl;
     Object *floor;
-    floor = new Floor(checkerboard);
+    floor = sceneArena.make<Floor>(checkerboard);
     objects.push_back(floor);
     floor->setCoEfficients( ka, kd, 0, kr);
 
@@ -424,6 +865,8 @@ void readFile()
     getline(file, line);
 
     float tokens[13];
+    // every cube and pyramid is an instance of one of these, made on first use
+    Prototype *box = NULL, *pyramid = NULL;
 
     while (getline(file, line))
     {
@@ -443,58 +886,16 @@ void readFile()
                     j++;
                 }
             }
-            Object *s1, *s2, *s3, *s4, *s5, *s6;
             point reference(tokens[0], tokens[1], tokens[2]);
-            point A(0, tokens[3], 0);
-            point B(0, tokens[3], tokens[3]);
-            point C(tokens[3], tokens[3], tokens[3]);
-            point D(tokens[3], tokens[3], 0);
-            point E(0, 0, 0);
-            point F(0, 0, tokens[3]);
-            point G(tokens[3], 0, tokens[3]);
-            point H(tokens[3], 0, 0);
-            point color(tokens[4], tokens[5], tokens[6]);
-            int shine = (int)tokens[11];
-            s1 = new square(A + reference, B + reference, C + reference, D + reference);
-            s2 = new square(E + reference, F + reference, G + reference, H + reference);
-            s3 = new square(E + reference, A + reference, B + reference, F + reference);
-            s4 = new square(F + reference, B + reference, C + reference, G + reference);
-            s5 = new square(G + reference, C + reference, D + reference, H + reference);
-            s6 = new square(H + reference, D + reference, A + reference, E + reference);
-            s1->setReferencePoint(reference);
-            s2->setReferencePoint(reference);
-            s3->setReferencePoint(reference);
-            s4->setReferencePoint(reference);
-            s5->setReferencePoint(reference);
-            s6->setReferencePoint(reference);
-            double ka = tokens[7];
-            double kd = tokens[8];
-            double ks = tokens[9];
-            double kr = tokens[10];
-            s1->setCoEfficients(ka, kd, ks, kr);
-            s2->setCoEfficients(ka, kd, ks, kr);
-            s3->setCoEfficients(ka, kd, ks, kr);
-            s4->setCoEfficients(ka, kd, ks, kr);
-            s5->setCoEfficients(ka, kd, ks, kr);
-            s6->setCoEfficients(ka, kd, ks, kr);
-            s1->setColor(color);
-            s2->setColor(color);
-            s3->setColor(color);
-            s4->setColor(color);
-            s5->setColor(color);
-            s6->setColor(color);
-            s1->setShine(shine);
-            s2->setShine(shine);
-            s3->setShine(shine);
-            s4->setShine(shine);
-            s5->setShine(shine);
-            s6->setShine(shine);
-            objects.push_back(s1);
-            objects.push_back(s2);
-            objects.push_back(s3);
-            objects.push_back(s4);
-            objects.push_back(s5);
-            objects.push_back(s6);
+            double side = tokens[3];
+            if (box == NULL)
+                box = makeBoxPrototype(sceneArena);
+            Object *cube = sceneArena.make<Instance>(box, Transform::scaleTranslate(point(side, side, side), reference));
+            cube->setReferencePoint(reference);
+            cube->setColor(point(tokens[4], tokens[5], tokens[6]));
+            cube->setCoEfficients(tokens[7], tokens[8], tokens[9], tokens[10]);
+            cube->setShine((int)tokens[11]);
+            objects.push_back(cube);
         }
         else if (line.compare("sphere") == 0)
         {
@@ -512,7 +913,7 @@ void readFile()
             }
             Object *s;
             point center(tokens[0], tokens[1], tokens[2]);
-            s = new sphere(center, tokens[3]);
+            s = sceneArena.make<sphere>(center, tokens[3]);
             point color(tokens[4], tokens[5], tokens[6]);
             s->setReferencePoint(center);
             s->setColor(color);
@@ -520,6 +921,35 @@ void readFile()
             s->setShine((int)tokens[11]);
             objects.push_back(s);
         }
+        else if (line.compare("mesh") == 0)
+        {
+            // file name, then the same five lines as a cube with the side
+            // as a uniform scale of the model's own coordinates
+            string meshFile;
+            getline(file, meshFile);
+            meshFile.erase(meshFile.find_last_not_of(" \t\r") + 1);
+            j = 0;
+            for (int i = 0; i < 5; i++)
+            {
+                getline(file, line);
+                istringstream iss8(line);
+                while (iss8 >> token)
+                {
+                    float number = stod(token);
+                    tokens[j] = number;
+                    j++;
+                }
+            }
+            point reference(tokens[0], tokens[1], tokens[2]);
+            double scale = tokens[3];
+            Object *m = sceneArena.make<Instance>(loadMesh(sceneArena, meshFile),
+                                                  Transform::scaleTranslate(point(scale, scale, scale), reference));
+            m->setReferencePoint(reference);
+            m->setColor(point(tokens[4], tokens[5], tokens[6]));
+            m->setCoEfficients(tokens[7], tokens[8], tokens[9], tokens[10]);
+            m->setShine((int)tokens[11]);
+            objects.push_back(m);
+        }
         else if (line.compare("pyramid") == 0)
         {
             j = 0;
@@ -534,48 +964,17 @@ void readFile()
                     j++;
                 }
             }
-            // , *s
-            Object *t1, *t2, *t3, *t4, *s;
             point reference(tokens[0], tokens[1], tokens[2]);
             double width = tokens[3];
             double height = tokens[4];
-            point color(tokens[5], tokens[6], tokens[7]);
-            point A(0, 0, 0);
-            point B(width, 0, 0);
-            point C(width, width, 0);
-            point D(0, width, 0);
-            point E(width/2.0, width/2.0, height);
-            int shine = (int)tokens[12];
-
-            t1 = new triangle(A + reference, B + reference, E + reference);
-            t2 = new triangle(B + reference, C + reference, E + reference);
-            t3 = new triangle(C + reference, D + reference, E + reference);
-            t4 = new triangle(D + reference, A + reference, E + reference);
-            s = new square(B + reference, C + reference, D + reference, E + reference);
-
-            t1->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
-            t2->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
-            t3->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
-            t4->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
-            s->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
-
-            s->setColor(color);
-            t1->setColor(color);
-            t2->setColor(color);
-            t3->setColor(color);
-            t4->setColor(color);
-
-            t1->setShine(shine);
-            t2->setShine(shine);
-            t3->setShine(shine);
-            t4->setShine(shine);
-            s->setShine(shine);
-
-            objects.push_back(t1);
-            objects.push_back(t2);
-            objects.push_back(t3);
-            objects.push_back(t4);
-            objects.push_back(s);
+            if (pyramid == NULL)
+                pyramid = makePyramidPrototype(sceneArena);
+            Object *p = sceneArena.make<Instance>(pyramid, Transform::scaleTranslate(point(width, width, height), reference));
+            p->setReferencePoint(reference);
+            p->setColor(point(tokens[5], tokens[6], tokens[7]));
+            p->setCoEfficients(tokens[8], tokens[9], tokens[10], tokens[11]);
+            p->setShine((int)tokens[12]);
+            objects.push_back(p);
         }
         else
         {
@@ -631,6 +1030,7 @@ void readFile()
         spot_lights.push_back(sl);
     }
     file.close();
+    bindShadingKernels();
 
     // cout << "Total objects: " << objects.size() << endl;
     // cout << "Point lights: " << normal_lights.size() << endl;
@@ -649,6 +1049,25 @@ void readFile()
     // }
 }
 
+// Ctrl+C in headless mode stops tracing instead of killing the process
+void interruptCapture(int sig)
+{
+    renderProgress.cancel = true;
+}
+
+// reload the scene file in place, e.g. after editing materials
+void reloadScene()
+{
+    cancelCapture();
+    bool pooled = renderPool.size() > 0;
+    renderPool.stop();
+    readFile();
+    buildAcceleration();
+    invalidatePreview();
+    if (pooled)
+        renderPool.start(renderThreads, pinThreads);
+}
+
 /* Main function: GLUT runs as a console application starting at main()  */
 int main(int argc, char **argv)
 {
@@ -668,7 +1087,174 @@ int main(int argc, char **argv)
     u = r ^ l;
     u.normalize();
 
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--headless")
+            headless = true;
+        else if (arg == "--tile" && i + 1 < argc)
+            tileSize = atoi(argv[++i]);
+        else if (arg == "--workers" && i + 1 < argc)
+            localWorkers = atoi(argv[++i]), headless = true;
+        else if (arg == "--listen" && i + 1 < argc)
+            listenPort = atoi(argv[++i]), headless = true;
+        else if (arg == "--worker" && i + 1 < argc)
+            workerAddress = argv[++i];
+        else if (arg == "--exposure" && i + 1 < argc)
+            exposure = atof(argv[++i]);
+        else if (arg == "--hdr" && i + 1 < argc)
+            hdrFile = argv[++i];
+        else if (arg == "--from-hdr" && i + 1 < argc)
+            fromHdr = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (arg == "--order" && i + 1 < argc)
+        {
+            if (!parseOrder(argv[++i], renderOrder))
+                cout << "Unknown order " << argv[i] << ", using " << orderName(renderOrder) << endl;
+        }
+        else if (arg == "--bench-order")
+            benchOrder = true;
+        else if (arg == "--bench-load" && i + 1 < argc)
+            benchLoads = atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            renderThreads = atoi(argv[++i]);
+        else if (arg == "--no-pin")
+            pinThreads = false;
+        else if (arg == "--fast-math")
+            fastMath = true;
+        else if (arg == "--bench-math")
+            benchMathMode = true;
+        else if (arg == "--min-weight" && i + 1 < argc)
+            minPathWeight = atof(argv[++i]);
+        else if (arg == "--roulette" && i + 1 < argc)
+            rouletteDepth = atoi(argv[++i]);
+        else if (arg == "--raster")
+            rasterPrimary = true;
+        else if (arg == "--bvh" && i + 1 < argc)
+            compressedBVH = string(argv[++i]) == "compressed";
+        else if (arg == "--bvh-build" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            bvhBuilder = name == "median" ? BUILD_MEDIAN : name == "lbvh" ? BUILD_LBVH : BUILD_SAH;
+        }
+        else if (arg == "--bench-bvh")
+            benchBvhMode = true;
+        else if (arg == "--crop" && i + 4 < argc)
+        {
+            int x = atoi(argv[i + 1]), y = atoi(argv[i + 2]);
+            cropWindow = Tile(0, x, y, x + max(1, atoi(argv[i + 3])), y + max(1, atoi(argv[i + 4])));
+            i += 4;
+        }
+        else if (arg == "--composite" && i + 1 < argc)
+            compositeFile = argv[++i];
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            checkpointFile = argv[++i];
+        else if (arg == "--denoise" && i + 1 < argc)
+            denoisePasses = atoi(argv[++i]);
+        else if (arg == "--denoise-sigma" && i + 1 < argc)
+            denoiseSigma = atof(argv[++i]);
+        else if (arg == "--scene" && i + 1 < argc)
+            sceneFile = argv[++i];
+        else if (arg == "--golden")
+        {
+            goldenMode = true;
+            while (i + 1 < argc && argv[i + 1][0] != '-')
+                goldenScenes.push_back(argv[++i]);
+        }
+        else if (arg == "--golden-psnr" && i + 1 < argc)
+            goldenPsnr = atof(argv[++i]);
+        else if (arg == "--golden-block" && i + 1 < argc)
+            goldenBlockPsnr = atof(argv[++i]);
+    }
+    if (tileSize <= 0)
+    {
+        cout << "--tile needs a positive size in pixels" << endl;
+        return 1;
+    }
+
+    tracer.enabled = traceFile != "";
+    tracer.nameThread(tracer.threadId(), "main");
+
+    if (fromHdr != "")
+    {
+        if (!loadPFM(framebuffer, fromHdr))
+            return 1;
+        saveFramebuffer();
+        return 0;
+    }
+
     readFile();
+    loadTextures();
+    if (cropWindow.pixelCount() > 0)
+    {
+        cropWindow.x0 = max(0, cropWindow.x0), cropWindow.y0 = max(0, cropWindow.y0);
+        cropWindow.x1 = min(pixel_size, cropWindow.x1), cropWindow.y1 = min(pixel_size, cropWindow.y1);
+        if (cropWindow.width() <= 0 || cropWindow.height() <= 0)
+        {
+            cout << "Crop window lies outside the " << pixel_size << "x" << pixel_size << " frame" << endl;
+            return 1;
+        }
+    }
+    {
+        TraceScope scope("buildAcceleration", "load");
+        buildAcceleration();
+    }
+
+    if (workerAddress != "")
+        return runRemoteWorker(workerAddress);
+
+    if (renderThreads <= 0)
+        renderThreads = thread::hardware_concurrency();
+    if (renderThreads > 1 && localWorkers == 0 && listenPort == 0)
+        renderPool.start(renderThreads, pinThreads);
+
+    if (benchLoads > 0)
+    {
+        benchLoad(benchLoads);
+        return 0;
+    }
+
+    if (benchOrder)
+    {
+        benchOrders();
+        return 0;
+    }
+
+    if (benchBvhMode)
+    {
+        benchBvh();
+        return 0;
+    }
+
+    if (benchMathMode)
+        return benchMath(40.0) ? 0 : 1;
+
+    if (goldenMode)
+    {
+        if (goldenScenes.empty())
+        {
+            goldenScenes.push_back("description.txt");
+            goldenScenes.push_back("scene_description.txt");
+        }
+        return runGolden(goldenScenes, goldenPsnr, goldenBlockPsnr) ? 0 : 1;
+    }
+
+    if (headless)
+    {
+        signal(SIGINT, interruptCapture);
+        startCapture();
+        while (capturing)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1000));
+            if (capturing)
+                cout << "Capturing: " << renderProgress.describe() << endl;
+        }
+        captureThread.join();
+        return renderProgress.cancel ? 1 : 0;
+    }
+
+    renderProgress.keepPreview = true;
 
     glutInit(&argc, argv);                                    // Initialize GLUT
     glutInitWindowSize(768, 768);                             // Set the window's initial width & height
@@ -679,6 +1265,7 @@ int main(int argc, char **argv)
     glutReshapeFunc(reshapeListener);                         // Register callback handler for window re-shape
     glutKeyboardFunc(keyboardListener);                       // Register callback handler for normal-key event
     glutSpecialFunc(specialKeyListener);                      // Register callback handler for special-key event
+    glutTimerFunc(500, captureTimer, 0);                      // Poll background captures
     initGL();                                                 // Our own OpenGL initialization
     glutMainLoop();                                           // Enter the event-processing loop
     texture_b.clear();
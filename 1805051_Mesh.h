@@ -0,0 +1,687 @@
+// Indexed triangle meshes ("mesh" in the scene file) read from binary or
+// ASCII PLY and from OBJ. Vertices are shared float triples and a triangle is
+// three vertex indices, 12 bytes plus its share of the BVH, instead of a full
+// Object with its own material. A mesh is a Prototype: each placement in the
+// scene is an Instance, and a file placed several times is parsed once. PLY
+// files are memory-mapped and decoded in place; OBJ files are mapped too and
+// scanned with a small number parser instead of streams.
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct MeshPrototype : public Prototype
+{
+    vector<float> vertices;       // x, y, z per vertex
+    vector<unsigned int> indices; // three vertex indices per triangle
+
+    int vertexCount() { return vertices.size() / 3; }
+
+    int triangleCount() { return indices.size() / 3; }
+
+    point vertex(unsigned int v) { return point(vertices[3 * v], vertices[3 * v + 1], vertices[3 * v + 2]); }
+
+    // call once the buffers are filled
+    void finishMesh()
+    {
+        int n = triangleCount();
+        vector<AABB> boxes(n);
+        bounds = AABB();
+        for (int k = 0; k < n; k++)
+        {
+            for (int c = 0; c < 3; c++)
+                boxes[k].expand(vertex(indices[3 * k + c]));
+            bounds.expand(boxes[k]);
+        }
+        accel.bvh.leafSize = 4;
+        accel.bvh.build(boxes);
+        // the boxes are only needed while building
+        vector<AABB>().swap(accel.bvh.itemBoxes);
+    }
+
+    // Moller-Trumbore; -1 if triangle k is missed or the hit is out of range
+    double hitTriangle(int k, Ray &ray)
+    {
+        point a = vertex(indices[3 * k]);
+        point e1 = vertex(indices[3 * k + 1]) - a, e2 = vertex(indices[3 * k + 2]) - a;
+        point p = ray.dir ^ e2;
+        double det = e1 * p;
+        if (det == 0)
+            return -1;
+        double inv = 1.0 / det;
+        point s = ray.origin - a;
+        double u = (s * p) * inv;
+        if (u < 0 || u > 1)
+            return -1;
+        point q = s ^ e1;
+        double v = (ray.dir * q) * inv;
+        if (v < 0 || u + v > 1)
+            return -1;
+        double t = (e2 * q) * inv;
+        return ray.accepts(t) ? t : -1;
+    }
+
+    virtual int nearest(Ray &ray, double &tHit)
+    {
+        int best = -1;
+        tHit = -1;
+        accel.bvh.traverse(ray, [&](int k)
+                           {
+                               double t = hitTriangle(k, ray);
+                               if (t > 0 && (best == -1 || t < tHit || (t == tHit && k < best)))
+                               {
+                                   tHit = ray.tmax = t;
+                                   best = k;
+                               }
+                               return false;
+                           });
+        return best;
+    }
+
+    virtual point faceNormal(int face, point p, Ray ray)
+    {
+        point a = vertex(indices[3 * face]);
+        point n = (vertex(indices[3 * face + 1]) - a) ^ (vertex(indices[3 * face + 2]) - a);
+        n.normalize();
+        return ray.dir * n > 0 ? -n : n;
+    }
+
+    virtual Prototype *clone(SceneArena &arena)
+    {
+        return arena.make<MeshPrototype>(*this);
+    }
+
+    virtual double faceDistance(int face, point p)
+    {
+        point a = vertex(indices[3 * face]);
+        point n = (vertex(indices[3 * face + 1]) - a) ^ (vertex(indices[3 * face + 2]) - a);
+        n.normalize();
+        return fabs((p - a) * n);
+    }
+
+    virtual void drawFaces()
+    {
+        glBegin(GL_TRIANGLES);
+        for (int i = 0; i < (int)indices.size(); i++)
+            glVertex3fv(&vertices[3 * indices[i]]);
+        glEnd();
+    }
+};
+
+// read-only view of a whole file, mapped where the platform allows
+struct MappedFile
+{
+    const char *data;
+    size_t size;
+#ifdef _WIN32
+    vector<char> buffer;
+#else
+    void *mapping;
+#endif
+
+    MappedFile() : data(NULL), size(0)
+    {
+#ifndef _WIN32
+        mapping = NULL;
+#endif
+    }
+
+    ~MappedFile() { close(); }
+
+    bool open(const string &path)
+    {
+        close();
+#ifdef _WIN32
+        ifstream in(path.c_str(), ios::binary);
+        if (!in)
+            return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        data = "";
+        if (size > 0)
+        {
+            mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                mapping = NULL;
+                size = 0;
+                ::close(fd);
+                return false;
+            }
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = (const char *)mapping;
+        }
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        buffer.clear();
+#else
+        if (mapping != NULL)
+            munmap(mapping, size);
+        mapping = NULL;
+#endif
+        data = NULL;
+        size = 0;
+    }
+};
+
+inline void skipBlanks(const char *&p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+}
+
+inline void skipSpace(const char *&p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+}
+
+inline void skipLine(const char *&p, const char *end)
+{
+    while (p < end && *p != '\n')
+        p++;
+    if (p < end)
+        p++;
+}
+
+// decimal number at p, which is moved past it; false if there is none
+bool parseNumber(const char *&p, const char *end, double &value)
+{
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    double mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        mantissa = mantissa * 10 + (*p - '0');
+    if (p < end && *p == '.')
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, exponent--)
+            mantissa = mantissa * 10 + (*p - '0');
+    if (digits == 0)
+    {
+        p = start;
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char *mark = p++;
+        bool negativeExp = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negativeExp = *p++ == '-';
+        int e = 0;
+        if (p < end && *p >= '0' && *p <= '9')
+        {
+            for (; p < end && *p >= '0' && *p <= '9'; p++)
+                e = min(100000, e * 10 + (*p - '0'));
+            exponent += negativeExp ? -e : e;
+        }
+        else
+            p = mark;
+    }
+    if (exponent >= 0)
+        value = mantissa * (exponent <= 22 ? powers[exponent] : pow(10.0, exponent));
+    else
+        value = exponent >= -22 ? mantissa / powers[-exponent] : mantissa * pow(10.0, exponent);
+    if (negative)
+        value = -value;
+    return true;
+}
+
+// integer at p, moved past it; false if there is none
+bool parseInteger(const char *&p, const char *end, long long &value)
+{
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p == end || *p < '0' || *p > '9')
+    {
+        p = start;
+        return false;
+    }
+    value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        value = min(1LL << 40, value * 10 + (*p - '0'));
+    if (negative)
+        value = -value;
+    return true;
+}
+
+// append the fan of a convex polygon's vertex indices as triangles
+void addPolygon(vector<unsigned int> &indices, const vector<unsigned int> &polygon)
+{
+    for (int k = 2; k < (int)polygon.size(); k++)
+    {
+        indices.push_back(polygon[0]);
+        indices.push_back(polygon[k - 1]);
+        indices.push_back(polygon[k]);
+    }
+}
+
+enum PlyType
+{
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+    PLY_NONE
+};
+
+const int plyTypeSize[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+PlyType plyTypeOf(const string &name)
+{
+    const char *names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                              {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    for (int t = 0; t < PLY_NONE; t++)
+        if (name == names[t][0] || name == names[t][1])
+            return (PlyType)t;
+    return PLY_NONE;
+}
+
+struct PlyProperty
+{
+    string name;
+    PlyType type;
+    PlyType countType; // PLY_NONE unless this is a list
+};
+
+struct PlyElement
+{
+    string name;
+    long long count;
+    vector<PlyProperty> properties;
+};
+
+// values of the body in order, binary in either byte order or text
+struct PlyReader
+{
+    const char *p, *end;
+    bool ascii, swap, failed;
+
+    double read(PlyType type)
+    {
+        if (ascii)
+        {
+            double v = 0;
+            skipSpace(p, end);
+            if (!parseNumber(p, end, v))
+                failed = true;
+            return v;
+        }
+        int size = plyTypeSize[type];
+        if (end - p < size)
+        {
+            failed = true;
+            p = end;
+            return 0;
+        }
+        unsigned char b[8];
+        memcpy(b, p, size);
+        p += size;
+        if (swap)
+            reverse(b, b + size);
+        switch (type)
+        {
+        case PLY_INT8:
+            return (int8_t)b[0];
+        case PLY_UINT8:
+            return b[0];
+        case PLY_INT16:
+        {
+            int16_t v;
+            memcpy(&v, b, 2);
+            return v;
+        }
+        case PLY_UINT16:
+        {
+            uint16_t v;
+            memcpy(&v, b, 2);
+            return v;
+        }
+        case PLY_INT32:
+        {
+            int32_t v;
+            memcpy(&v, b, 4);
+            return v;
+        }
+        case PLY_UINT32:
+        {
+            uint32_t v;
+            memcpy(&v, b, 4);
+            return v;
+        }
+        case PLY_FLOAT32:
+        {
+            float v;
+            memcpy(&v, b, 4);
+            return v;
+        }
+        default:
+        {
+            double v;
+            memcpy(&v, b, 8);
+            return v;
+        }
+        }
+    }
+};
+
+// vertex positions and the faces' "vertex_indices" lists; other elements and
+// properties are read past
+bool loadPly(const string &path, MeshPrototype &mesh, string &error)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        error = "cannot open file";
+        return false;
+    }
+    const char *p = file.data, *end = file.data + file.size;
+
+    // the header is short text, ended by the end_header line
+    vector<PlyElement> elements;
+    string format;
+    bool sawMagic = false, sawEnd = false;
+    while (p < end && !sawEnd)
+    {
+        const char *lineEnd = (const char *)memchr(p, '\n', end - p);
+        if (lineEnd == NULL)
+            lineEnd = end;
+        istringstream line(string(p, lineEnd));
+        p = lineEnd < end ? lineEnd + 1 : end;
+        string word;
+        line >> word;
+        if (!sawMagic)
+        {
+            if (word != "ply")
+            {
+                error = "not a PLY file";
+                return false;
+            }
+            sawMagic = true;
+        }
+        else if (word == "format")
+            line >> format;
+        else if (word == "element")
+        {
+            PlyElement e;
+            line >> e.name >> e.count;
+            elements.push_back(e);
+        }
+        else if (word == "property")
+        {
+            if (elements.empty())
+            {
+                error = "property before any element";
+                return false;
+            }
+            PlyProperty prop;
+            string type;
+            line >> type;
+            prop.countType = PLY_NONE;
+            if (type == "list")
+            {
+                string countType;
+                line >> countType >> type;
+                prop.countType = plyTypeOf(countType);
+                if (prop.countType == PLY_NONE)
+                {
+                    error = "unknown type " + countType;
+                    return false;
+                }
+            }
+            prop.type = plyTypeOf(type);
+            line >> prop.name;
+            if (prop.type == PLY_NONE)
+            {
+                error = "unknown type " + type;
+                return false;
+            }
+            elements.back().properties.push_back(prop);
+        }
+        else if (word == "end_header")
+            sawEnd = true;
+    }
+    if (!sawEnd)
+    {
+        error = "header has no end_header";
+        return false;
+    }
+
+    unsigned int probe = 1;
+    bool littleHost = *(unsigned char *)&probe == 1;
+    PlyReader in = {p, end, format == "ascii", false, false};
+    if (format == "binary_little_endian")
+        in.swap = !littleHost;
+    else if (format == "binary_big_endian")
+        in.swap = littleHost;
+    else if (!in.ascii)
+    {
+        error = "unknown format " + format;
+        return false;
+    }
+
+    long long vertexTotal = 0;
+    for (int e = 0; e < (int)elements.size(); e++)
+        if (elements[e].name == "vertex")
+            vertexTotal = elements[e].count;
+
+    vector<unsigned int> polygon;
+    for (int e = 0; e < (int)elements.size() && !in.failed; e++)
+    {
+        PlyElement &element = elements[e];
+        vector<PlyProperty> &props = element.properties;
+        int xyz[3] = {-1, -1, -1}, list = -1;
+        for (int k = 0; k < (int)props.size(); k++)
+        {
+            if (props[k].countType == PLY_NONE && props[k].name.size() == 1 && props[k].name[0] >= 'x' &&
+                props[k].name[0] <= 'z')
+                xyz[props[k].name[0] - 'x'] = k;
+            if (props[k].countType != PLY_NONE && (props[k].name == "vertex_indices" || props[k].name == "vertex_index"))
+                list = k;
+        }
+        bool isVertex = element.name == "vertex", isFace = element.name == "face";
+        if (isVertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0))
+        {
+            error = "vertices without x, y and z";
+            return false;
+        }
+        if (isFace && list < 0)
+        {
+            error = "faces without vertex_indices";
+            return false;
+        }
+        // a count the rest of the file cannot hold is a damaged header
+        long long minBytes = 0;
+        for (int k = 0; k < (int)props.size(); k++)
+            minBytes += in.ascii ? 1 : plyTypeSize[props[k].countType != PLY_NONE ? props[k].countType : props[k].type];
+        if (element.count < 0 || (minBytes > 0 && element.count > (in.end - in.p) / minBytes))
+        {
+            error = "file ends early";
+            return false;
+        }
+        if (isVertex)
+            mesh.vertices.resize(3 * element.count);
+        if (isFace)
+            mesh.indices.reserve(3 * element.count);
+
+        for (long long i = 0; i < element.count && !in.failed; i++)
+            for (int k = 0; k < (int)props.size(); k++)
+            {
+                PlyProperty &prop = props[k];
+                if (prop.countType == PLY_NONE)
+                {
+                    double v = in.read(prop.type);
+                    if (isVertex)
+                        for (int c = 0; c < 3; c++)
+                            if (k == xyz[c])
+                                mesh.vertices[3 * i + c] = v;
+                    continue;
+                }
+                long long n = (long long)in.read(prop.countType);
+                polygon.clear();
+                for (long long m = 0; m < n && !in.failed; m++)
+                {
+                    double v = in.read(prop.type);
+                    if (isFace && k == list)
+                    {
+                        if (v < 0 || v >= vertexTotal)
+                        {
+                            error = "face index out of range";
+                            return false;
+                        }
+                        polygon.push_back((unsigned int)v);
+                    }
+                }
+                if (isFace && k == list)
+                    addPolygon(mesh.indices, polygon);
+            }
+    }
+    if (in.failed)
+    {
+        error = "file ends early or holds a bad number";
+        return false;
+    }
+    return true;
+}
+
+// "v x y z" and "f a b c ..." lines; texture and normal indices after a
+// slash are ignored, negative indices count back from the last vertex
+bool loadObj(const string &path, MeshPrototype &mesh, string &error)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        error = "cannot open file";
+        return false;
+    }
+    const char *p = file.data, *end = file.data + file.size;
+    vector<unsigned int> polygon;
+    long long lineNumber = 0;
+    while (p < end)
+    {
+        lineNumber++;
+        skipBlanks(p, end);
+        if (end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+            for (int c = 0; c < 3; c++)
+            {
+                double v;
+                skipBlanks(p, end);
+                if (!parseNumber(p, end, v))
+                {
+                    error = "bad vertex on line " + to_string(lineNumber);
+                    return false;
+                }
+                mesh.vertices.push_back(v);
+            }
+        }
+        else if (end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+            long long count = mesh.vertices.size() / 3;
+            polygon.clear();
+            while (true)
+            {
+                skipBlanks(p, end);
+                long long index;
+                if (!parseInteger(p, end, index))
+                    break;
+                // skip "/texture/normal"
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                    p++;
+                index = index < 0 ? count + index : index - 1;
+                if (index < 0 || index >= count)
+                {
+                    error = "face index out of range on line " + to_string(lineNumber);
+                    return false;
+                }
+                polygon.push_back((unsigned int)index);
+            }
+            addPolygon(mesh.indices, polygon);
+        }
+        skipLine(p, end);
+    }
+    return true;
+}
+
+// meshes of the current scene by file name, so each file is read once;
+// emptied with the scene arena that owns them
+map<string, MeshPrototype *> loadedMeshes;
+
+// the mesh in path (.ply or .obj), parsed on first use; exits if unreadable
+// or empty like a missing scene file
+MeshPrototype *loadMesh(SceneArena &arena, const string &path)
+{
+    map<string, MeshPrototype *>::iterator found = loadedMeshes.find(path);
+    if (found != loadedMeshes.end())
+        return found->second;
+
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    MeshPrototype *mesh = arena.make<MeshPrototype>();
+    mesh->name = path;
+    string ext = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    string error;
+    bool ok = false;
+    if (ext == ".ply")
+        ok = loadPly(path, *mesh, error);
+    else if (ext == ".obj")
+        ok = loadObj(path, *mesh, error);
+    else
+        error = "expected a .ply or .obj file";
+    // an empty mesh has no bounds to place its instances by
+    if (ok && mesh->triangleCount() == 0)
+    {
+        error = "no faces";
+        ok = false;
+    }
+    if (!ok)
+    {
+        cout << "Unable to load mesh " << path << ": " << error << endl;
+        exit(1);
+    }
+    mesh->finishMesh();
+    loadedMeshes[path] = mesh;
+    cout << "Mesh " << path << ": " << mesh->vertexCount() << " vertices, " << mesh->triangleCount()
+         << " triangles in "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin).count() << " ms ("
+         << mesh->accel.bvh.summary() << ")" << endl;
+    return mesh;
+}
@@ -0,0 +1,338 @@
+// Persistent render thread pool.
+//
+// Workers are pinned to individual cores and grouped by NUMA node. On
+// machines with more than one node, the first worker of every node clones the
+// scene objects and acceleration structure into memory it touches first, so
+// each node traces against a local replica. The framebuffer is split into one
+// horizontal band per node; tiles are queued on the node owning their band and
+// a node only steals from other queues once its own is empty.
+
+#include <thread>
+#include <condition_variable>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+struct NumaNode
+{
+    int id;
+    vector<int> cpus;
+};
+
+// "0-3,8-11" -> {0,1,2,3,8,9,10,11}
+vector<int> parseCpuList(const string &text)
+{
+    vector<int> cpus;
+    stringstream ss(text);
+    string range;
+    while (getline(ss, range, ','))
+    {
+        if (range.empty() || !isdigit(range[0]))
+            continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for (int c = first; c <= last; c++)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+
+vector<NumaNode> detectNumaNodes()
+{
+    vector<NumaNode> nodes;
+#ifdef __linux__
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != NULL)
+    {
+        dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() < 5 || !isdigit(name[4]))
+                continue;
+            ifstream in(("/sys/devices/system/node/" + name + "/cpulist").c_str());
+            string text;
+            getline(in, text);
+            NumaNode node;
+            node.id = atoi(name.c_str() + 4);
+            node.cpus = parseCpuList(text);
+            if (!node.cpus.empty())
+                nodes.push_back(node);
+        }
+        closedir(dir);
+    }
+    sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b)
+         { return a.id < b.id; });
+#endif
+    if (nodes.empty())
+    {
+        NumaNode node;
+        node.id = 0;
+        int n = max(1u, thread::hardware_concurrency());
+        for (int c = 0; c < n; c++)
+            node.cpus.push_back(c);
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+bool pinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// node-local copy of the read-only scene; instances get node-local copies
+// of their prototypes (faces, mesh buffers and hierarchies), one per
+// prototype so instances sharing it on the source still share it here
+struct SceneReplica
+{
+    SceneArena arena;
+    vector<Object *> objects;
+    SceneAccel accel;
+    vector<SceneAccel> spotAccels;
+
+    SceneReplica(const vector<Object *> &source, const SceneAccel &sourceAccel, const vector<SceneAccel> &sourceSpots)
+    {
+        map<Prototype *, Prototype *> prototypes;
+        for (int i = 0; i < (int)source.size(); i++)
+        {
+            objects.push_back(source[i]->clone(arena));
+            Instance *inst = dynamic_cast<Instance *>(objects.back());
+            if (inst == NULL)
+                continue;
+            Prototype *&copy = prototypes[inst->proto];
+            if (copy == NULL)
+                copy = inst->proto->clone(arena);
+            inst->proto = copy;
+        }
+        accel = sourceAccel;
+        spotAccels = sourceSpots;
+    }
+};
+
+struct RenderPool
+{
+    struct Worker
+    {
+        int node, cpu;
+    };
+
+    vector<NumaNode> nodes;
+    vector<Worker> workers;
+    vector<thread> threads;
+    vector<SceneReplica *> replicas; // per node; null means trace the global scene
+    bool pin;
+
+    mutex lock;
+    condition_variable wake, done;
+    int generation;
+    bool quit;
+    int replicasReady;
+
+    // current frame
+    const vector<Tile> *tiles;
+    vector<vector<int>> queues; // tile indices per node
+    vector<int> queueNext;
+    vector<Framebuffer> bands; // one slice of rows per node
+    vector<int> bandStart;
+    int bandsReady;
+    int busy;
+
+    RenderPool() : pin(true), generation(0), quit(false), replicasReady(0), tiles(NULL), bandsReady(0), busy(0) {}
+
+    ~RenderPool() { stop(); }
+
+    int size() { return threads.size(); }
+
+    void start(int count, bool pinThreads)
+    {
+        stop();
+        pin = pinThreads;
+        nodes = detectNumaNodes();
+        // spread workers round-robin over nodes, then over each node's cores
+        vector<int> used(nodes.size(), 0);
+        for (int i = 0; i < count; i++)
+        {
+            int n = i % nodes.size();
+            Worker w = {n, nodes[n].cpus[used[n]++ % nodes[n].cpus.size()]};
+            workers.push_back(w);
+        }
+        int activeNodes = min((int)nodes.size(), count);
+        nodes.resize(activeNodes);
+        replicas.assign(activeNodes, (SceneReplica *)NULL);
+        bands.assign(activeNodes, Framebuffer());
+        quit = false;
+        replicasReady = 0;
+        for (int i = 0; i < count; i++)
+            threads.push_back(thread(&RenderPool::run, this, i, generation));
+
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&]
+                  { return replicasReady == activeNodes; });
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (int i = 0; i < (int)threads.size(); i++)
+            threads[i].join();
+        threads.clear();
+        workers.clear();
+        for (int i = 0; i < (int)replicas.size(); i++)
+            delete replicas[i];
+        replicas.clear();
+    }
+
+    bool leaderOf(int index, int node)
+    {
+        for (int i = 0; i < index; i++)
+            if (workers[i].node == node)
+                return false;
+        return true;
+    }
+
+    void run(int index, int seen)
+    {
+        Worker me = workers[index];
+        if (pin)
+            pinCurrentThread(me.cpu);
+        tracer.nameThread(tracer.threadId(), "render " + to_string(index) + " (node " + to_string(nodes[me.node].id) +
+                                                 ", cpu " + to_string(me.cpu) + ")");
+        bool leader = leaderOf(index, me.node);
+
+        // node 0 keeps using the scene loaded by the main thread
+        if (leader)
+        {
+            if (me.node > 0)
+                replicas[me.node] = new SceneReplica(objects, sceneAccel, spotOccluders);
+            lock_guard<mutex> guard(lock);
+            replicasReady++;
+            done.notify_all();
+        }
+
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&]
+                          { return quit || generation != seen; });
+                if (quit)
+                    return;
+                seen = generation;
+            }
+            if (replicas[me.node] != NULL)
+                activeScene = {&replicas[me.node]->objects, &replicas[me.node]->accel, &replicas[me.node]->spotAccels};
+            else
+                activeScene = {&objects, &sceneAccel, &spotOccluders};
+
+            // first touch of the node's band happens on the node
+            if (leader)
+            {
+                int rows = (me.node + 1 < (int)bandStart.size() ? bandStart[me.node + 1] : pixel_size) - bandStart[me.node];
+                bands[me.node].resize(pixel_size, rows);
+                bands[me.node].originY = bandStart[me.node];
+                lock_guard<mutex> guard(lock);
+                bandsReady++;
+                done.notify_all();
+            }
+            {
+                unique_lock<mutex> guard(lock);
+                done.wait(guard, [&]
+                          { return bandsReady == (int)bands.size(); });
+            }
+
+            vector<float> rgb;
+            int node, k;
+            while (nextTile(me.node, node, k))
+            {
+                const Tile &t = (*tiles)[k];
+                TraceScope scope("tile " + to_string(t.id), "tile");
+                rgb.assign(t.pixelCount() * 3, 0.0f);
+                renderTile(t, rgb.data());
+                storeTile(bands[node], t, rgb.data());
+                renderProgress.finish(t, rgb.data());
+            }
+
+            lock_guard<mutex> guard(lock);
+            busy--;
+            done.notify_all();
+        }
+    }
+
+    // own node first, then steal from the others
+    bool nextTile(int home, int &node, int &tile)
+    {
+        if (renderProgress.cancel)
+            return false;
+        lock_guard<mutex> guard(lock);
+        for (int i = 0; i < (int)queues.size(); i++)
+        {
+            node = (home + i) % queues.size();
+            if (queueNext[node] < (int)queues[node].size())
+            {
+                tile = queues[node][queueNext[node]++];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // render all tiles into fb (pixel_size x pixel_size)
+    void render(const vector<Tile> &frameTiles, Framebuffer &fb, int tileSize)
+    {
+        int n = bands.size();
+        // band boundaries on tile rows so a tile never straddles two nodes
+        int tileRows = (pixel_size + tileSize - 1) / tileSize;
+        bandStart.assign(n, 0);
+        for (int i = 0; i < n; i++)
+            bandStart[i] = min(pixel_size, (tileRows * i / n) * tileSize);
+
+        queues.assign(n, vector<int>());
+        queueNext.assign(n, 0);
+        for (int k = 0; k < (int)frameTiles.size(); k++)
+        {
+            int node = n - 1;
+            while (node > 0 && frameTiles[k].y0 < bandStart[node])
+                node--;
+            queues[node].push_back(k);
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            tiles = &frameTiles;
+            bandsReady = 0;
+            busy = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        {
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [&]
+                      { return busy == 0; });
+        }
+
+        if (n == 1)
+        {
+            swap(fb, bands[0]);
+            fb.originY = 0;
+            return;
+        }
+        fb.resize(pixel_size, pixel_size);
+        for (int i = 0; i < n; i++)
+            copy(bands[i].rgb.begin(), bands[i].rgb.end(), fb.pixel(0, bandStart[i]));
+    }
+};
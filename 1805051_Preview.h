@@ -0,0 +1,108 @@
+// Retained-mode preview for the GLUT window. Everything except spheres is
+// compiled once into a display list (the floor's 2,500 quads become a single
+// batch). Spheres share a few unit-sphere lists of increasing tessellation
+// and each one picks a level from its size on screen. invalidatePreview()
+// must be called whenever the object list changes.
+
+extern GLfloat fov;
+
+const int SPHERE_LODS = 4;
+const int sphereSlices[SPHERE_LODS] = {8, 16, 32, 50};
+
+struct PreviewCache
+{
+    GLuint sceneList;  // 0 until built
+    GLuint sphereBase; // SPHERE_LODS consecutive lists, 0 until built
+    vector<Object *> spheres;
+    bool dirty;
+
+    PreviewCache() : sceneList(0), sphereBase(0), dirty(true) {}
+};
+
+PreviewCache preview;
+
+void invalidatePreview()
+{
+    preview.dirty = true;
+}
+
+// needs the GL context, so it runs from display()
+void buildPreview()
+{
+    if (preview.sphereBase == 0)
+    {
+        preview.sphereBase = glGenLists(SPHERE_LODS);
+        for (int k = 0; k < SPHERE_LODS; k++)
+        {
+            glNewList(preview.sphereBase + k, GL_COMPILE);
+            glutSolidSphere(1.0, sphereSlices[k], sphereSlices[k]);
+            glEndList();
+        }
+    }
+    if (preview.sceneList != 0)
+        glDeleteLists(preview.sceneList, 1);
+    preview.sceneList = glGenLists(1);
+    preview.spheres.clear();
+
+    glNewList(preview.sceneList, GL_COMPILE);
+    for (int i = 0; i < (int)objects.size(); i++)
+    {
+        point center;
+        double radius;
+        if (objects[i]->getSphere(center, radius))
+            preview.spheres.push_back(objects[i]);
+        else
+            objects[i]->draw();
+    }
+    glEndList();
+    preview.dirty = false;
+}
+
+// p rotated like glRotated(degrees, 0, 1, 0)
+point rotateY(point p, double degrees)
+{
+    double a = degrees * M_PI / 180.0;
+    return point(p.x * cos(a) + p.z * sin(a), p.y, -p.x * sin(a) + p.z * cos(a));
+}
+
+// tessellation level for a sphere of the given radius seen from the eye
+int sphereLod(point center, double radius, point eye, double pixelsPerUnit)
+{
+    double dist = max(radius, (center - eye).length());
+    double pixels = radius / dist * pixelsPerUnit;
+    if (pixels < 8)
+        return 0;
+    if (pixels < 32)
+        return 1;
+    if (pixels < 128)
+        return 2;
+    return 3;
+}
+
+// eye and forward in the coordinates the objects are drawn in
+void drawPreview(point eye, point forward)
+{
+    if (preview.dirty)
+        buildPreview();
+    glCallList(preview.sceneList);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    double pixelsPerUnit = viewport[3] / 2.0 / tan(fov * M_PI / 360.0);
+    for (int i = 0; i < (int)preview.spheres.size(); i++)
+    {
+        Object *s = preview.spheres[i];
+        point center;
+        double radius;
+        s->getSphere(center, radius);
+        // entirely behind the eye
+        if ((center - eye) * forward < -radius)
+            continue;
+        glPushMatrix();
+        glColor3f(s->color.x, s->color.y, s->color.z);
+        glTranslated(center.x, center.y, center.z);
+        glScaled(radius, radius, radius);
+        glCallList(preview.sphereBase + sphereLod(center, radius, eye, pixelsPerUnit));
+        glPopMatrix();
+    }
+}
@@ -0,0 +1,218 @@
+// Rasterized primary visibility (--raster). Before the tiles are traced, every
+// object is drawn into a visibility buffer holding the nearest object index
+// and ray distance per pixel: polygons are clipped, projected and scanned
+// with edge functions, other bounded objects are ray tested only inside
+// their projected box. Primary rays then start shading from the stored hit
+// and only shadow and reflection rays go through the BVH.
+
+extern point topLeft, camEye, camRight, camUp, camForward;
+extern double du, dv;
+extern GLfloat near_plane, far_plane;
+extern int pixel_size;
+
+struct VisibilityBuffer
+{
+    int width, height;
+    Tile window;          // pixels actually rasterized, the rest stays sky
+    vector<int> id;       // object index, -1 for sky
+    vector<double> depth; // distance along the normalized primary ray
+
+    VisibilityBuffer() : width(0), height(0) {}
+
+    bool ready() { return width > 0; }
+
+    void clear()
+    {
+        width = height = 0;
+        id.clear();
+        depth.clear();
+    }
+
+    void reset(int w, int h, const Tile &region)
+    {
+        width = w;
+        height = h;
+        window = region;
+        id.assign(w * h, -1);
+        depth.assign(w * h, 1e300);
+    }
+
+    // keep the nearer hit; ties go to the lower index like nearestObject
+    void write(int i, int j, int object, double t)
+    {
+        int k = j * width + i;
+        if (t > 0 && (t < depth[k] || (t == depth[k] && object < id[k])))
+        {
+            depth[k] = t;
+            id[k] = object;
+        }
+    }
+};
+
+VisibilityBuffer visibility;
+
+// normalized primary ray direction through pixel (i, j)
+point pixelDirection(double i, double j)
+{
+    point d = topLeft + (camRight * du * i) - (camUp * dv * j) - camEye;
+    d.normalize();
+    return d;
+}
+
+// camera ray along dir, limited to the stretch between the near and far
+// planes like the preview's clip volume
+Ray primaryRay(point dir)
+{
+    Ray ray(camEye, dir);
+    double along = ray.dir * camForward;
+    if (along > 0)
+    {
+        ray.tmin = near_plane / along;
+        ray.tmax = far_plane / along;
+    }
+    return ray;
+}
+
+// continuous pixel coordinates of a point in front of the eye
+void projectToPixel(point p, double &i, double &j)
+{
+    point v = p - camEye;
+    point onPlane = camEye + v * (near_plane / (v * camForward)) - topLeft;
+    i = (onPlane * camRight) / du;
+    j = -(onPlane * camUp) / dv;
+}
+
+// points closer to the eye plane than this are clipped away before projecting
+const double RASTER_NEAR = 1e-4;
+
+// convex polygon, clipped against the plane just in front of the eye
+void rasterPolygon(VisibilityBuffer &vb, int object, point *verts, int n)
+{
+    point normal = (verts[1] - verts[0]) ^ (verts[2] - verts[0]);
+    double planeDist = normal * (verts[0] - camEye);
+
+    // Sutherland-Hodgman against z_camera >= RASTER_NEAR
+    vector<point> clipped;
+    for (int k = 0; k < n; k++)
+    {
+        point a = verts[k], b = verts[(k + 1) % n];
+        double za = (a - camEye) * camForward - RASTER_NEAR;
+        double zb = (b - camEye) * camForward - RASTER_NEAR;
+        if (za >= 0)
+            clipped.push_back(a);
+        if ((za >= 0) != (zb >= 0))
+            clipped.push_back(a + (b - a) * (za / (za - zb)));
+    }
+    int m = clipped.size();
+    if (m < 3)
+        return;
+
+    vector<double> x(m), y(m);
+    double lo[2] = {1e300, 1e300}, hi[2] = {-1e300, -1e300};
+    for (int k = 0; k < m; k++)
+    {
+        projectToPixel(clipped[k], x[k], y[k]);
+        lo[0] = min(lo[0], x[k]), hi[0] = max(hi[0], x[k]);
+        lo[1] = min(lo[1], y[k]), hi[1] = max(hi[1], y[k]);
+    }
+    double area = 0;
+    for (int k = 0; k < m; k++)
+        area += x[k] * y[(k + 1) % m] - x[(k + 1) % m] * y[k];
+    if (fabs(area) < 1e-12)
+        return;
+    double side = area > 0 ? 1 : -1;
+
+    // edge functions in pixels, widened a little so silhouettes are not lost;
+    // a pixel the object does not really cover falls back to a ray cast
+    const double slack = 1e-3;
+    vector<double> ea(m), eb(m), ec(m);
+    for (int k = 0; k < m; k++)
+    {
+        int l = (k + 1) % m;
+        double dx = x[l] - x[k], dy = y[l] - y[k];
+        double len = sqrt(dx * dx + dy * dy);
+        if (len < 1e-12)
+            len = 1e-12;
+        ea[k] = -dy * side / len;
+        eb[k] = dx * side / len;
+        ec[k] = -(ea[k] * x[k] + eb[k] * y[k]) + slack;
+    }
+
+    // clamp before converting; clipped vertices can project far off screen
+    int i0 = (int)max((double)vb.window.x0, ceil(lo[0] - slack)), i1 = (int)min(vb.window.x1 - 1.0, floor(hi[0] + slack));
+    int j0 = (int)max((double)vb.window.y0, ceil(lo[1] - slack)), j1 = (int)min(vb.window.y1 - 1.0, floor(hi[1] + slack));
+    for (int j = j0; j <= j1; j++)
+        for (int i = i0; i <= i1; i++)
+        {
+            bool inside = true;
+            for (int k = 0; k < m && inside; k++)
+                inside = ea[k] * i + eb[k] * j + ec[k] >= 0;
+            if (!inside)
+                continue;
+            Ray ray = primaryRay(pixelDirection(i, j));
+            double denom = normal * ray.dir;
+            if (fabs(denom) > 1e-12 && ray.accepts(planeDist / denom))
+                vb.write(i, j, object, planeDist / denom);
+        }
+}
+
+// any other bounded object: exact ray tests inside its projected box
+void rasterBounded(VisibilityBuffer &vb, int object, Object *obj, point lo, point hi)
+{
+    double x0 = 1e300, x1 = -1e300, y0 = 1e300, y1 = -1e300;
+    bool behind = false;
+    for (int k = 0; k < 8; k++)
+    {
+        point c((k & 1) ? hi.x : lo.x, (k & 2) ? hi.y : lo.y, (k & 4) ? hi.z : lo.z);
+        if ((c - camEye) * camForward < RASTER_NEAR)
+        {
+            behind = true;
+            break;
+        }
+        double i, j;
+        projectToPixel(c, i, j);
+        x0 = min(x0, i), x1 = max(x1, i);
+        y0 = min(y0, j), y1 = max(y1, j);
+    }
+    int i0 = vb.window.x0, i1 = vb.window.x1 - 1, j0 = vb.window.y0, j1 = vb.window.y1 - 1;
+    if (!behind)
+    {
+        i0 = (int)max((double)i0, floor(x0)), i1 = (int)min((double)i1, ceil(x1));
+        j0 = (int)max((double)j0, floor(y0)), j1 = (int)min((double)j1, ceil(y1));
+    }
+    point col;
+    for (int j = j0; j <= j1; j++)
+        for (int i = i0; i <= i1; i++)
+        {
+            Ray ray = primaryRay(pixelDirection(i, j));
+            vb.write(i, j, object, obj->intersect_shapes(ray, col));
+        }
+}
+
+// fill window of vb for the current camera (setupCamera must have run)
+void rasterizeVisibility(VisibilityBuffer &vb, const Tile &window)
+{
+    vector<Object *> &objs = *activeScene.objects;
+    vb.reset(pixel_size, pixel_size, window);
+    point verts[8];
+    for (int k = 0; k < (int)objs.size(); k++)
+    {
+        int n = objs[k]->getPolygon(verts);
+        point lo, hi;
+        if (n >= 3)
+            rasterPolygon(vb, k, verts, n);
+        else if (objs[k]->getExtent(lo, hi))
+            rasterBounded(vb, k, objs[k], lo, hi);
+        else
+        {
+            // unbounded and not a polygon: every pixel
+            point col;
+            for (int j = window.y0; j < window.y1; j++)
+                for (int i = window.x0; i < window.x1; i++)
+                {
+                    Ray ray = primaryRay(pixelDirection(i, j));
+                    vb.write(i, j, k, objs[k]->intersect_shapes(ray, col));
+                }
+        }
+    }
+}
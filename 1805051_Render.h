@@ -0,0 +1,353 @@
+// Tile bookkeeping shared by the local capture loop and the distributed renderer
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+struct Tile
+{
+    int id;
+    int x0, y0, x1, y1; // pixel rectangle [x0, x1) x [y0, y1)
+
+    Tile() : id(-1), x0(0), y0(0), x1(0), y1(0) {}
+    Tile(int id, int x0, int y0, int x1, int y1) : id(id), x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    int pixelCount() const { return width() * height(); }
+};
+
+// split a size x size image into tiles of at most tileSize x tileSize pixels
+vector<Tile> makeTiles(int size, int tileSize)
+{
+    vector<Tile> tiles;
+    if (tileSize <= 0)
+        tileSize = size;
+    for (int y = 0; y < size; y += tileSize)
+    {
+        for (int x = 0; x < size; x += tileSize)
+        {
+            int id = tiles.size();
+            tiles.push_back(Tile(id, x, y, min(x + tileSize, size), min(y + tileSize, size)));
+        }
+    }
+    return tiles;
+}
+
+// clip tiles to a crop window and drop the ones outside it; ids are kept
+void cropTiles(vector<Tile> &tiles, const Tile &window)
+{
+    vector<Tile> kept;
+    for (int k = 0; k < (int)tiles.size(); k++)
+    {
+        Tile t = tiles[k];
+        t.x0 = max(t.x0, window.x0), t.y0 = max(t.y0, window.y0);
+        t.x1 = min(t.x1, window.x1), t.y1 = min(t.y1, window.y1);
+        if (t.x0 < t.x1 && t.y0 < t.y1)
+            kept.push_back(t);
+    }
+    tiles.swap(kept);
+}
+
+// Order in which tiles, and pixels inside a tile, are traced. Space filling
+// curves keep consecutive rays close together on screen, so they touch the
+// same primitives, texels and framebuffer lines.
+enum TileOrder
+{
+    ORDER_SCANLINE,
+    ORDER_MORTON,
+    ORDER_HILBERT
+};
+
+const char *orderName(TileOrder order)
+{
+    switch (order)
+    {
+    case ORDER_MORTON:
+        return "morton";
+    case ORDER_HILBERT:
+        return "hilbert";
+    default:
+        return "scanline";
+    }
+}
+
+bool parseOrder(const string &name, TileOrder &order)
+{
+    for (int o = ORDER_SCANLINE; o <= ORDER_HILBERT; o++)
+    {
+        if (name == orderName((TileOrder)o))
+        {
+            order = (TileOrder)o;
+            return true;
+        }
+    }
+    return false;
+}
+
+// interleave the bits of x and y
+unsigned int mortonKey(unsigned int x, unsigned int y)
+{
+    unsigned int key = 0;
+    for (int b = 0; b < 16; b++)
+        key |= ((x >> b) & 1u) << (2 * b) | ((y >> b) & 1u) << (2 * b + 1);
+    return key;
+}
+
+// distance of (x, y) along the Hilbert curve filling an n x n grid, n a power of two
+unsigned int hilbertKey(unsigned int n, unsigned int x, unsigned int y)
+{
+    unsigned int d = 0;
+    for (unsigned int s = n / 2; s > 0; s /= 2)
+    {
+        unsigned int rx = (x & s) > 0;
+        unsigned int ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+unsigned int curveKey(TileOrder order, unsigned int n, unsigned int x, unsigned int y)
+{
+    if (order == ORDER_MORTON)
+        return mortonKey(x, y);
+    if (order == ORDER_HILBERT)
+        return hilbertKey(n, x, y);
+    return y * n + x;
+}
+
+unsigned int powerOfTwoAtLeast(unsigned int v)
+{
+    unsigned int n = 1;
+    while (n < v)
+        n *= 2;
+    return n;
+}
+
+// sort tiles along the curve through the tile grid
+void orderTiles(vector<Tile> &tiles, TileOrder order, int tileSize)
+{
+    if (tiles.empty() || order == ORDER_SCANLINE)
+        return;
+    int gridW = 0, gridH = 0;
+    for (int i = 0; i < (int)tiles.size(); i++)
+    {
+        gridW = max(gridW, tiles[i].x0 / tileSize + 1);
+        gridH = max(gridH, tiles[i].y0 / tileSize + 1);
+    }
+    unsigned int n = powerOfTwoAtLeast(max(gridW, gridH));
+    sort(tiles.begin(), tiles.end(), [&](const Tile &a, const Tile &b)
+         { return curveKey(order, n, a.x0 / tileSize, a.y0 / tileSize) <
+                  curveKey(order, n, b.x0 / tileSize, b.y0 / tileSize); });
+}
+
+// row-major offsets of a w x h block, listed in curve order
+void curveOffsets(int w, int h, TileOrder order, vector<int> &offsets)
+{
+    offsets.clear();
+    if (order == ORDER_SCANLINE)
+    {
+        for (int i = 0; i < w * h; i++)
+            offsets.push_back(i);
+        return;
+    }
+    unsigned int n = powerOfTwoAtLeast(max(w, h));
+    vector<pair<unsigned int, int>> keyed;
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            keyed.push_back(make_pair(curveKey(order, n, x, y), y * w + x));
+    sort(keyed.begin(), keyed.end());
+    for (int i = 0; i < (int)keyed.size(); i++)
+        offsets.push_back(keyed[i].second);
+}
+
+// Linear, unclamped RGB radiance for the whole image. Tiles are traced into
+// it and it is only quantized to 8-bit once, when the image is written out.
+struct Framebuffer
+{
+    int width, height;
+    int originY; // image row stored in the first row (bands of a larger image)
+    vector<float> rgb; // row-major, 3 floats per pixel
+
+    Framebuffer() : width(0), height(0), originY(0) {}
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        rgb.assign((size_t)w * h * 3, 0.0f);
+    }
+
+    float *pixel(int x, int y) { return &rgb[((size_t)(y - originY) * width + x) * 3]; }
+};
+
+// --checkpoint journal of finished tiles (1805051_Checkpoint.h)
+void journalTile(const Tile &tile, const float *rgb);
+
+// Progress of the frame being rendered. Tile loops call finish() for every
+// completed tile and stop picking up new tiles once cancel is set. With
+// keepPreview on, finished tiles are also kept as 8-bit RGB for the window.
+struct RenderProgress
+{
+    atomic<int> done, total;
+    atomic<bool> cancel;
+    chrono::steady_clock::time_point start;
+    bool keepPreview;
+    mutex lock;
+    int width;
+    vector<unsigned char> preview; // row-major RGB, top row first
+    vector<Tile> finished;
+
+    RenderProgress() : done(0), total(0), cancel(false), keepPreview(false), width(0) {}
+
+    void begin(int tiles, int size)
+    {
+        lock_guard<mutex> guard(lock);
+        done = 0;
+        total = tiles;
+        cancel = false;
+        start = chrono::steady_clock::now();
+        finished.clear();
+        width = size;
+        if (keepPreview)
+            preview.assign((size_t)size * size * 3, 0);
+    }
+
+    void finish(const Tile &tile, const float *rgb)
+    {
+        journalTile(tile, rgb);
+        if (keepPreview)
+        {
+            lock_guard<mutex> guard(lock);
+            for (int y = tile.y0; y < tile.y1; y++)
+            {
+                unsigned char *p = &preview[((size_t)y * width + tile.x0) * 3];
+                for (int k = 0; k < tile.width() * 3; k++)
+                    p[k] = 255 * min(1.0f, max(0.0f, *rgb++));
+            }
+            finished.push_back(tile);
+        }
+        done++;
+    }
+
+    double elapsed()
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // seconds left at the average rate so far, -1 before the first tile
+    double eta()
+    {
+        int d = done;
+        if (d == 0)
+            return -1;
+        return elapsed() * (total - d) / d;
+    }
+
+    string describe()
+    {
+        int d = done, t = total;
+        stringstream ss;
+        ss << d << "/" << t << " tiles (" << fixed << setprecision(1) << (t ? 100.0 * d / t : 0.0) << "%), "
+           << elapsed() << " s elapsed";
+        double left = eta();
+        if (left >= 0)
+            ss << ", ETA " << left << " s";
+        return ss.str();
+    }
+};
+
+RenderProgress renderProgress;
+
+// eye and axes a render is traced from; a background capture gets a copy
+// taken on the main thread, which keeps moving pos, l, r and u
+struct CameraPose
+{
+    point pos, l, r, u;
+};
+
+// implemented in the main translation unit
+CameraPose currentCamera();
+void setupCamera(CameraPose cam);
+void setupCamera();
+void renderTile(const Tile &tile, float *rgb);
+bool renderFrame();
+void reloadScene();
+
+// copy a rendered tile (row-major linear RGB) into the framebuffer
+void storeTile(Framebuffer &fb, const Tile &tile, const float *rgb)
+{
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+        copy(rgb, rgb + tile.width() * 3, fb.pixel(tile.x0, y));
+        rgb += tile.width() * 3;
+    }
+}
+
+// copy a window of a full image into out
+void cropFramebuffer(Framebuffer &fb, const Tile &window, Framebuffer &out)
+{
+    out.resize(window.width(), window.height());
+    for (int y = window.y0; y < window.y1; y++)
+        copy(fb.pixel(window.x0, y), fb.pixel(window.x0, y) + window.width() * 3, out.pixel(0, y - window.y0));
+}
+
+// final 8-bit conversion: scale by exposure, clamp to [0,1], round and store
+void quantize(Framebuffer &fb, bitmap_image &img, double exposure = 1.0)
+{
+    if ((int)img.width() != fb.width || (int)img.height() != fb.height)
+        img.setwidth_height(fb.width, fb.height);
+    img.import_rgb_interleaved(fb.rgb.data(), exposure);
+}
+
+// Portable float map: little-endian floats, bottom row first
+bool savePFM(Framebuffer &fb, const string &fileName)
+{
+    ofstream out(fileName.c_str(), ios::binary);
+    if (!out)
+    {
+        cout << "Unable to write " << fileName << endl;
+        return false;
+    }
+    out << "PF\n" << fb.width << " " << fb.height << "\n-1.0\n";
+    for (int y = fb.height - 1; y >= 0; y--)
+        out.write((const char *)fb.pixel(0, y), sizeof(float) * 3 * fb.width);
+    return true;
+}
+
+bool loadPFM(Framebuffer &fb, const string &fileName)
+{
+    ifstream in(fileName.c_str(), ios::binary);
+    string magic;
+    int w, h;
+    double scale;
+    bool ok = (bool)(in >> magic >> w >> h >> scale) && magic == "PF" && scale < 0 && w > 0 && h > 0;
+    if (ok)
+    {
+        in.get(); // single whitespace before the raster
+        // the raster must fit in what is left of the file before it is allocated
+        streampos start = in.tellg();
+        in.seekg(0, ios::end);
+        long long left = (long long)(in.tellg() - start);
+        in.seekg(start);
+        ok = in && (long long)w * h * 3 * (long long)sizeof(float) <= left;
+    }
+    if (!ok)
+    {
+        cout << "Unable to read little-endian RGB PFM " << fileName << endl;
+        return false;
+    }
+    fb.resize(w, h);
+    for (int y = h - 1; y >= 0; y--)
+        in.read((char *)fb.pixel(0, y), sizeof(float) * 3 * w);
+    return (bool)in;
+}
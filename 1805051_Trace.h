@@ -0,0 +1,120 @@
+// Optional timeline instrumentation. Scopes record complete ("X") events and
+// writeTrace() dumps them as Chrome trace-event JSON, which loads directly in
+// Perfetto (ui.perfetto.dev) or chrome://tracing.
+
+#include <chrono>
+#include <mutex>
+#include <atomic>
+
+struct TraceEvent
+{
+    string name, cat;
+    long long ts, dur; // microseconds since the recorder started
+    int tid;
+};
+
+struct TraceRecorder
+{
+    bool enabled;
+    mutex lock;
+    vector<TraceEvent> events;
+    vector<pair<int, string>> threadNames;
+    chrono::steady_clock::time_point start;
+    atomic<int> nextTid;
+
+    TraceRecorder() : enabled(false), start(chrono::steady_clock::now()), nextTid(1) {}
+
+    long long now()
+    {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    // small stable id for the calling thread
+    int threadId()
+    {
+        thread_local int tid = 0;
+        if (tid == 0)
+            tid = nextTid++;
+        return tid;
+    }
+
+    void record(const string &name, const string &cat, long long ts, long long end, int tid)
+    {
+        if (!enabled)
+            return;
+        TraceEvent e = {name, cat, ts, end - ts, tid};
+        lock_guard<mutex> guard(lock);
+        events.push_back(e);
+    }
+
+    void nameThread(int tid, const string &name)
+    {
+        if (!enabled)
+            return;
+        lock_guard<mutex> guard(lock);
+        for (int i = 0; i < (int)threadNames.size(); i++)
+            if (threadNames[i].first == tid)
+                return;
+        threadNames.push_back(make_pair(tid, name));
+    }
+};
+
+TraceRecorder tracer;
+
+// records the lifetime of the scope as one event on the calling thread
+struct TraceScope
+{
+    string name;
+    const char *cat;
+    long long begin;
+
+    TraceScope(const string &name, const char *cat = "render") : name(name), cat(cat), begin(0)
+    {
+        if (tracer.enabled)
+            begin = tracer.now();
+    }
+
+    ~TraceScope()
+    {
+        if (tracer.enabled)
+            tracer.record(name, cat, begin, tracer.now(), tracer.threadId());
+    }
+};
+
+string jsonEscape(const string &s)
+{
+    string out;
+    for (int i = 0; i < (int)s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        out += s[i];
+    }
+    return out;
+}
+
+bool writeTrace(const string &fileName)
+{
+    ofstream out(fileName.c_str());
+    if (!out)
+    {
+        cout << "Unable to write " << fileName << endl;
+        return false;
+    }
+    lock_guard<mutex> guard(tracer.lock);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"raytracer\"}}";
+    for (int i = 0; i < (int)tracer.threadNames.size(); i++)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tracer.threadNames[i].first
+            << ",\"args\":{\"name\":\"" << jsonEscape(tracer.threadNames[i].second) << "\"}}";
+    }
+    for (int i = 0; i < (int)tracer.events.size(); i++)
+    {
+        TraceEvent &e = tracer.events[i];
+        out << ",\n{\"name\":\"" << jsonEscape(e.name) << "\",\"cat\":\"" << e.cat
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur << "}";
+    }
+    out << "\n]}\n";
+    return true;
+}
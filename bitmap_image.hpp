@@ -31,6 +31,14 @@
 #include <limits>
 #include <string>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BITMAP_IMAGE_SSE2
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 
 class bitmap_image
 {
@@ -846,6 +854,74 @@ public:
       }
    }
 
+   /*
+      Bulk import of interleaved RGB floats (width * height * 3 values, row-major,
+      top row first). Each value is scaled by 255 * scale, clamped to [0,255],
+      rounded to nearest and stored as BGR.
+   */
+   inline void import_rgb_interleaved(const float* rgb, const float scale = 1.0f)
+   {
+      if (bgr_mode != channel_mode_)
+         return;
+
+      const float k = 255.0f * scale;
+      unsigned char* itr = data_;
+      unsigned char* end = data_ + length_;
+
+      #ifdef BITMAP_IMAGE_SSE2
+      const __m128 vk   = _mm_set1_ps(k);
+      const __m128 vmin = _mm_setzero_ps();
+      const __m128 vmax = _mm_set1_ps(255.0f);
+      #if defined(__SSSE3__)
+      const __m128i rgb_to_bgr = _mm_setr_epi8(2,1,0,5,4,3,8,7,6,11,10,9,-1,-1,-1,-1);
+      #endif
+
+      // four pixels (12 channels) per iteration
+      while ((end - itr) >= 12)
+      {
+         __m128 f0 = _mm_loadu_ps(rgb    );
+         __m128 f1 = _mm_loadu_ps(rgb + 4);
+         __m128 f2 = _mm_loadu_ps(rgb + 8);
+
+         f0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f0,vk),vmin),vmax);
+         f1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f1,vk),vmin),vmax);
+         f2 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f2,vk),vmin),vmax);
+
+         __m128i w01 = _mm_packs_epi32(_mm_cvtps_epi32(f0),_mm_cvtps_epi32(f1));
+         __m128i w2  = _mm_packs_epi32(_mm_cvtps_epi32(f2),_mm_setzero_si128());
+         __m128i b   = _mm_packus_epi16(w01,w2);
+
+         #if defined(__SSSE3__)
+         b = _mm_shuffle_epi8(b,rgb_to_bgr);
+         #endif
+
+         unsigned char tmp[16];
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(tmp),b);
+
+         #if defined(__SSSE3__)
+         std::copy(tmp, tmp + 12, itr);
+         #else
+         for (int i = 0; i < 12; i += 3)
+         {
+            itr[i + 0] = tmp[i + 2];
+            itr[i + 1] = tmp[i + 1];
+            itr[i + 2] = tmp[i + 0];
+         }
+         #endif
+
+         itr += 12;
+         rgb += 12;
+      }
+      #endif
+
+      for (; itr < end; itr += 3, rgb += 3)
+      {
+         itr[0] = static_cast<unsigned char>(std::lrint(clamp<float>(k * rgb[2],0.0f,255.0f)));
+         itr[1] = static_cast<unsigned char>(std::lrint(clamp<float>(k * rgb[1],0.0f,255.0f)));
+         itr[2] = static_cast<unsigned char>(std::lrint(clamp<float>(k * rgb[0],0.0f,255.0f)));
+      }
+   }
+
    inline void subsample(bitmap_image& dest)
    {
       /*